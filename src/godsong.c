@@ -12,27 +12,80 @@
  *
  * You should have received a copy of the GNU General Public License along with
  * this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * ============================================================================
+ *
+ * The beat patterns used by the generator are not hardcoded, they are described
+ * by a "style", which is compiled into bytecode by `compile_style' and then run
+ * by `run_pattern'. A style is a text file with one directive per line, and
+ * with comments starting with '#'. These are the supported directives:
+ *
+ *     octave <base> <split>
+ *         Notes are placed in the <base> octave if their random index
+ *         (0..7, where 0 is 'G') is lower than <split>, or in the next octave
+ *         otherwise.
+ *
+ *     rests
+ *         Allow rests in the generated songs. Terry doesn't use them.
+ *
+ *     meter <beats> [<prefix>]
+ *         Allow songs of <beats> beats. The optional <prefix> is written after
+ *         the first octave, and it's normally used for meter specifiers like
+ *         "M6/8".
+ *
+ *     pattern <name> <body...>
+ *         Define a beat pattern. The body is a list of tokens:
+ *           - A TempleOS duration, like 'q', 'e', 'et' or 'e.'. It's only
+ *             written if it differs from the last written duration, except for
+ *             dotted durations, which only affect one note.
+ *           - 'N', a new random note.
+ *           - '$<n>', repeat the n-th random note of the current pattern,
+ *             starting from 1.
+ *
+ *     simple|normal|complex <pattern-names...>
+ *         List of patterns to choose from for each complexity. The same name
+ *         can be repeated to make a pattern more frequent.
+ *
+ * See `default_style' for Terry's patterns, written in this language.
  */
 
+#define _POSIX_C_SOURCE 200809L /* getopt(), open_memstream() */
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h> /* time() */
+#include <errno.h>
+#include <time.h>   /* time() */
+#include <unistd.h> /* getopt() */
+
+#include "sketch.h"
 
 #define LENGTH(ARR) (sizeof(ARR) / sizeof((ARR)[0]))
 
-enum EDurations {
-    DUR_4           = 0,
-    DUR_8_8         = 1,
-    DUR_3_3_3       = 2,
-    DUR_16_16_16_16 = 3,
-    DUR_8DOT_16     = 4,
-    DUR_8_16_16     = 5,
-    DUR_16_16_8     = 6,
-};
+/*
+ * Limits of the compiled styles.
+ */
+#define MAX_CODE      1024
+#define MAX_PATTERNS  32
+#define MAX_DURATIONS 16
+#define MAX_WEIGHTS   64
+#define MAX_METERS    8
+#define MAX_SLOTS     8
+#define MAX_NAME      32
+#define MAX_BEATS     256
+
+/*
+ * Maximum number of simultaneous voices, see `godvoices'.
+ */
+#define MAX_VOICES 4
+
+/*
+ * Number of diatonic pitches, see `note_pitch'.
+ */
+#define PITCH_NUM (10 * 7)
 
 enum EComplexities {
     COMPLEXITY_SIMPLE  = 0,
@@ -40,32 +93,121 @@ enum EComplexities {
     COMPLEXITY_COMPLEX = 2,
 };
 
-static uint8_t god_simple_songs[]  = { DUR_4, DUR_4, DUR_4, DUR_4, DUR_8_8 };
-static uint8_t god_normal_songs[]  = { DUR_4,
-                                       DUR_4,
-                                       DUR_8_8,
-                                       DUR_3_3_3,
-                                       DUR_16_16_16_16 };
-static uint8_t god_complex_songs[] = {
-    DUR_4,     DUR_4,       DUR_8_8,     DUR_8_8,        DUR_8DOT_16,
-    DUR_3_3_3, DUR_8_16_16, DUR_16_16_8, DUR_16_16_16_16
+/*
+ * Instructions of the compiled patterns. Each opcode is followed by a single
+ * operand byte, except for `OP_END'.
+ */
+enum EOpcodes {
+    OP_END      = 0, /* End of the pattern */
+    OP_DUR      = 1, /* Write duration <operand>, if it changed */
+    OP_DUR_ONCE = 2, /* Always write duration <operand> (e.g. dotted) */
+    OP_NOTE     = 3, /* Write a random note, and store it in slot <operand> */
+    OP_REPEAT   = 4, /* Write the note stored in slot <operand> */
 };
 
 /*
- * Should we use rests in the current song? Terry sets it to 'false'.
+ * Value of the duration register when no duration has been written.
+ */
+#define DUR_NONE 0xFF
+
+struct Style {
+    /* Bytecode of all patterns, see `EOpcodes' */
+    uint8_t code[MAX_CODE];
+    size_t code_sz;
+
+    /* Offset in `code' of each pattern, and its name */
+    uint16_t pattern_pc[MAX_PATTERNS];
+    char pattern_name[MAX_PATTERNS][MAX_NAME];
+    int pattern_num;
+
+    /* Upper bound of the characters written by each pattern */
+    int pattern_max_chars[MAX_PATTERNS];
+
+    /* Duration strings, indexed by the `OP_DUR' operands */
+    char durations[MAX_DURATIONS][4];
+    int duration_num;
+
+    /* The same durations, parsed for the sketches, see `sketch_note' */
+    struct SketchDuration sketch_durations[MAX_DURATIONS];
+
+    /* Patterns for each complexity */
+    uint8_t weights[3][MAX_WEIGHTS];
+    int weight_num[3];
+
+    /* Allowed song lengths, and their prefixes */
+    int meter_beats[MAX_METERS];
+    char meter_prefix[MAX_METERS][MAX_NAME];
+    int meter_num;
+
+    int octave_base;
+    int octave_split;
+    bool use_rests;
+};
+
+/*
+ * Terry's patterns, from `GodSongStr'.
+ */
+static const char* default_style =
+  "octave 4 3\n"
+  "meter 8\n"
+  "meter 6 M6/8\n"
+  "pattern 4           q N\n"
+  "pattern 8_8         e N N\n"
+  "pattern 3_3_3       et N N N\n"
+  "pattern 16_16_16_16 s N N $1 $2\n"
+  "pattern 8DOT_16     e. N s N\n"
+  "pattern 8_16_16     e N s N N\n"
+  "pattern 16_16_8     s N N e N\n"
+  "simple  4 4 4 4 8_8\n"
+  "normal  4 4 8_8 3_3_3 16_16_16_16\n"
+  "complex 4 4 8_8 8_8 8DOT_16 3_3_3 8_16_16 16_16_8 16_16_16_16\n";
+
+/*
+ * Style used by `godsong'.
+ */
+static struct Style g_style;
+
+/*
+ * Intervals allowed between simultaneous notes of adjacent voices, in diatonic
+ * steps modulo an octave: octaves, thirds, fifths and sixths.
  */
-static bool g_use_rests = false;
+static const bool allowed_intervals[7] = {
+    true, false, true, false, true, true, false,
+};
 
 /*
- * Octave of the current note.
+ * For each voice below the first one, the pitch of the voice above it, and the
+ * random note index of the voice, this table contains the closest note index
+ * that forms an allowed interval without crossing the voice above. See
+ * `init_harmony'.
  */
-static uint64_t g_octave = 4;
+static uint8_t g_harmony[MAX_VOICES][PITCH_NUM][8];
 
 /*
- * Currently effective octave, according to what we have written in the song
- * buffer. Doesn't need to match `octave'.
+ * One of the lines generated by `godvoices'.
  */
-static uint64_t g_octave_old;
+struct Voice {
+    char* buf;
+    int buf_pos;
+
+    /* Octave of the current note */
+    uint64_t octave;
+
+    /*
+     * Currently effective octave, according to what we have written in the
+     * song buffer. Doesn't need to match `octave'.
+     */
+    uint64_t octave_old;
+
+    /* Last duration written to the buffer, see `OP_DUR' */
+    uint8_t dur_reg;
+
+    /* Notes of the current pattern, see `OP_REPEAT' */
+    uint8_t slots[MAX_SLOTS];
+
+    /* Staff of `g_sketch' that receives the notes, or NULL */
+    struct SketchStaff* staff;
+};
 
 /*----------------------------------------------------------------------------*/
 
@@ -93,163 +235,937 @@ static inline char octave2char(int octave) {
 }
 
 /*
- * Get a note duration with the specified `complexity'.
+ * Get the index of a pattern in `g_style' with the specified `complexity'.
  *
  * NOTE: The `random' parameter could be removed, since we always pass
  * 'godbits(8)'.
  */
 static uint8_t get_duration(int complexity, int random) {
-    switch (complexity) {
-        case 0:
-            return god_simple_songs[random % LENGTH(god_simple_songs)];
-        case 1:
-            return god_normal_songs[random % LENGTH(god_normal_songs)];
-        case 2:
-            return god_complex_songs[random % LENGTH(god_complex_songs)];
-        default:
-            fprintf(stderr, "Invalid complexity.");
-            abort();
+    if (complexity < 0 || complexity > 2 ||
+        g_style.weight_num[complexity] <= 0) {
+        fprintf(stderr, "Invalid complexity.");
+        abort();
     }
+
+    return g_style.weights[complexity][random % g_style.weight_num[complexity]];
 }
 
 /*
- * Insert a note into `buf' at `buf_pos'.
+ * Return the diatonic pitch (7 per octave, starting at C) of the note with the
+ * specified index (0..7, where 0 is 'G') for a voice in `octave'.
  */
-static void insert_note(char* buf, int* buf_pos, uint64_t random) {
-    if (random == 0 && g_use_rests) {
-        buf[(*buf_pos)++] = 'R';
-        return;
+static inline int note_pitch(int octave, int index) {
+    if (index >= g_style.octave_split)
+        octave++;
+
+    return octave * 7 + (index + 4) % 7;
+}
+
+/*
+ * Add the note that was just written by `voice' to its staff of `g_sketch'.
+ */
+static void sketch_note(struct Voice* voice, char octave) {
+    static const struct SketchDuration no_duration = SKETCH_QUARTER;
+    const struct SketchDuration* duration =
+      (voice->dur_reg != DUR_NONE) ? &g_style.sketch_durations[voice->dur_reg]
+                                   : &no_duration;
+    const char note = voice->buf[voice->buf_pos - 1];
+
+    staff_note(g_sketch,
+               voice->staff,
+               sketch_token(octave, duration, '\0', note),
+               duration->ticks);
+}
+
+/*
+ * Insert a note into the buffer of `voice'. Returns its diatonic pitch, or -1
+ * if it's a rest.
+ */
+static int insert_note(struct Voice* voice, uint64_t random) {
+    if (random == 0 && g_style.use_rests) {
+        voice->buf[voice->buf_pos++] = 'R';
+        if (voice->staff != NULL)
+            sketch_note(voice, '-');
+        return -1;
     }
 
     /*
      * TODO: I am sure the logic behind these conditionals can be improved.
      */
     random /= 2;
-    if (random < 3) {
-        if (g_octave_old != g_octave) {
-            g_octave_old      = g_octave;
-            buf[(*buf_pos)++] = octave2char(g_octave_old);
+    if (random < (uint64_t)g_style.octave_split) {
+        if (voice->octave_old != voice->octave) {
+            voice->octave_old            = voice->octave;
+            voice->buf[voice->buf_pos++] = octave2char(voice->octave_old);
         }
     } else {
-        if (g_octave_old != g_octave + 1) {
-            g_octave_old      = g_octave + 1;
-            buf[(*buf_pos)++] = octave2char(g_octave_old);
+        if (voice->octave_old != voice->octave + 1) {
+            voice->octave_old            = voice->octave + 1;
+            voice->buf[voice->buf_pos++] = octave2char(voice->octave_old);
         }
     }
 
-    buf[(*buf_pos)++] = (random == 0) ? 'G' : random - 1 + 'A';
+    voice->buf[voice->buf_pos++] = (random == 0) ? 'G' : random - 1 + 'A';
+    if (voice->staff != NULL)
+        sketch_note(voice, octave2char(voice->octave_old));
+    return note_pitch(voice->octave, random);
 }
 
-char* godsong(int len, int complexity) {
-    /* Allow six eighths */
-    assert(len == 8 || len == 6);
+/*
+ * Can a voice in `octave' play the note with the specified index below the
+ * `upper' pitch?
+ */
+static bool is_allowed(int upper, int octave, int index) {
+    const int interval = upper - note_pitch(octave, index);
+    return interval > 0 && allowed_intervals[interval % 7];
+}
 
-    /* Random seed, used by `godbits' */
-    srand(time(NULL));
+/*
+ * Fill `g_harmony' for the current style. Each voice is placed one octave
+ * below the previous one.
+ */
+static void init_harmony(void) {
+    for (int voice = 1; voice < MAX_VOICES; voice++) {
+        const int octave = g_style.octave_base - voice;
+        if (octave < 0)
+            break;
 
-    char* buf   = calloc(256, sizeof(char));
-    int buf_pos = 0;
+        for (int upper = 0; upper < PITCH_NUM; upper++) {
+            for (int index = 0; index < 8; index++) {
+                g_harmony[voice][upper][index] = index;
 
-    /*
-     * FIXME: Why does he do this?
-     */
-    g_octave_old   = g_octave + 1;
-    buf[buf_pos++] = octave2char(g_octave_old);
-    if (len == 6) {
-        buf[buf_pos++] = 'M';
-        buf[buf_pos++] = '6';
-        buf[buf_pos++] = '/';
-        buf[buf_pos++] = '8';
+                /* Search the closest allowed index, in both directions */
+                for (int dist = 0; dist < 8; dist++) {
+                    const int down = index - dist;
+                    const int up   = index + dist;
+                    int found      = -1;
+
+                    if (down >= 0 && is_allowed(upper, octave, down))
+                        found = down;
+                    else if (up < 8 && is_allowed(upper, octave, up))
+                        found = up;
+
+                    if (found >= 0) {
+                        g_harmony[voice][upper][index] = found;
+                        break;
+                    }
+                }
+            }
+        }
     }
+}
 
-    uint8_t last_duration = -1;
-    for (int i = 0; i < len; i++) {
-        uint8_t duration = get_duration(complexity, godbits(8));
+/*
+ * Adjust the `random' note of `voice' so it forms an allowed interval with the
+ * `upper' pitch of the voice above it.
+ */
+static inline uint64_t harmonize(int voice, int upper, uint64_t random) {
+    if (upper < 0 || upper >= PITCH_NUM || (random == 0 && g_style.use_rests))
+        return random;
 
-        switch (duration) {
-            case DUR_8_8: {
-                if (last_duration != DUR_8_8)
-                    buf[buf_pos++] = 'e';
+    const int index = random / 2;
+    const int fixed = g_harmony[voice][upper][index];
+    return (fixed == index) ? random : (uint64_t)fixed * 2 + 1;
+}
 
-                insert_note(buf, &buf_pos, godbits(4));
-                insert_note(buf, &buf_pos, godbits(4));
-            } break;
+/*----------------------------------------------------------------------------*/
 
-            case DUR_8DOT_16: {
-                buf[buf_pos++] = 'e';
-                buf[buf_pos++] = '.';
-                insert_note(buf, &buf_pos, godbits(4));
-                buf[buf_pos++] = 's';
-                insert_note(buf, &buf_pos, godbits(4));
-                duration = DUR_16_16_16_16;
-            } break;
+/*
+ * Split the next whitespace-separated token from `*str', and store it in
+ * `dst', which should be able to hold `MAX_NAME' characters. Returns false if
+ * there are no more tokens in the current line.
+ */
+static bool next_token(const char** str, char* dst) {
+    const char* p = *str;
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        p++;
+
+    if (*p == '\0' || *p == '\n' || *p == '#') {
+        *str = p;
+        return false;
+    }
+
+    size_t i = 0;
+    while (*p != '\0' && *p != '\n' && *p != ' ' && *p != '\t' &&
+           *p != '\r') {
+        if (i + 1 < MAX_NAME)
+            dst[i++] = *p;
+        p++;
+    }
+    dst[i] = '\0';
+
+    *str = p;
+    return true;
+}
+
+/*
+ * Is `str' a valid TempleOS duration, optionally followed by the triplet and
+ * dot modifiers?
+ */
+static bool is_duration_token(const char* str) {
+    if (*str == '\0' || strchr("whqes", *str) == NULL)
+        return false;
+    str++;
+
+    if (*str == 't')
+        str++;
+    if (*str == '.')
+        str++;
+
+    return *str == '\0';
+}
+
+/*
+ * Get the index of `name' in the patterns of `style', or -1 if it doesn't
+ * exist.
+ */
+static int find_pattern(const struct Style* style, const char* name) {
+    for (int i = 0; i < style->pattern_num; i++)
+        if (strcmp(style->pattern_name[i], name) == 0)
+            return i;
+
+    return -1;
+}
+
+/*
+ * Get the index of duration `str' in `style', adding it if necessary. Returns
+ * -1 if there is no space left.
+ */
+static int intern_duration(struct Style* style, const char* str) {
+    for (int i = 0; i < style->duration_num; i++)
+        if (strcmp(style->durations[i], str) == 0)
+            return i;
+
+    if (style->duration_num >= MAX_DURATIONS)
+        return -1;
 
-            case DUR_3_3_3: {
-                if (last_duration != DUR_3_3_3) {
-                    buf[buf_pos++] = 'e';
-                    buf[buf_pos++] = 't';
+    strcpy(style->durations[style->duration_num], str);
+    style->sketch_durations[style->duration_num] = sketch_duration(str);
+    return style->duration_num++;
+}
+
+/*
+ * Compile the body of a "pattern" directive, starting at `*str'.
+ */
+static bool compile_pattern(struct Style* style, const char** str,
+                            const char* name, int line) {
+    if (style->pattern_num >= MAX_PATTERNS) {
+        fprintf(stderr, "Style:%d: Too many patterns.\n", line);
+        return false;
+    }
+    if (find_pattern(style, name) != -1) {
+        fprintf(stderr, "Style:%d: Duplicated pattern '%s'.\n", line, name);
+        return false;
+    }
+
+    const int pattern = style->pattern_num++;
+    strcpy(style->pattern_name[pattern], name);
+    style->pattern_pc[pattern]        = style->code_sz;
+    style->pattern_max_chars[pattern] = 0;
+
+    int slot_num = 0;
+    char token[MAX_NAME];
+    while (next_token(str, token)) {
+        /* Each instruction uses two bytes, and we need one for `OP_END' */
+        if (style->code_sz + 3 > MAX_CODE) {
+            fprintf(stderr, "Style:%d: Patterns are too long.\n", line);
+            return false;
+        }
+
+        uint8_t opcode, operand;
+        if (strcmp(token, "N") == 0) {
+            if (slot_num >= MAX_SLOTS) {
+                fprintf(stderr, "Style:%d: Too many notes.\n", line);
+                return false;
+            }
+
+            opcode  = OP_NOTE;
+            operand = slot_num++;
+            style->pattern_max_chars[pattern] += 2;
+        } else if (token[0] == '$') {
+            const int slot = atoi(&token[1]) - 1;
+            if (slot < 0 || slot >= slot_num) {
+                fprintf(stderr, "Style:%d: Invalid reference '%s'.\n", line,
+                        token);
+                return false;
+            }
+
+            opcode  = OP_REPEAT;
+            operand = slot;
+            style->pattern_max_chars[pattern] += 2;
+        } else if (is_duration_token(token)) {
+            const int duration = intern_duration(style, token);
+            if (duration < 0) {
+                fprintf(stderr, "Style:%d: Too many durations.\n", line);
+                return false;
+            }
+
+            opcode  = (strchr(token, '.') != NULL) ? OP_DUR_ONCE : OP_DUR;
+            operand = duration;
+            style->pattern_max_chars[pattern] += strlen(token);
+        } else {
+            fprintf(stderr, "Style:%d: Invalid token '%s'.\n", line, token);
+            return false;
+        }
+
+        style->code[style->code_sz++] = opcode;
+        style->code[style->code_sz++] = operand;
+    }
+
+    style->code[style->code_sz++] = OP_END;
+    return true;
+}
+
+/*
+ * Compile the list of patterns of a complexity directive.
+ */
+static bool compile_weights(struct Style* style, const char** str,
+                            int complexity, int line) {
+    style->weight_num[complexity] = 0;
+
+    char token[MAX_NAME];
+    while (next_token(str, token)) {
+        const int pattern = find_pattern(style, token);
+        if (pattern < 0) {
+            fprintf(stderr, "Style:%d: Unknown pattern '%s'.\n", line, token);
+            return false;
+        }
+        if (style->weight_num[complexity] >= MAX_WEIGHTS) {
+            fprintf(stderr, "Style:%d: Too many patterns.\n", line);
+            return false;
+        }
+
+        style->weights[complexity][style->weight_num[complexity]++] = pattern;
+    }
+
+    return true;
+}
+
+/*
+ * Parse the whole `str' as a decimal integer between `min' and `max'. Returns
+ * false if it's not a number, or if it's out of range.
+ */
+static bool parse_int(const char* str, int min, int max, int* dst) {
+    char* end;
+    errno            = 0;
+    const long value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || errno != 0 || value < min ||
+        value > max)
+        return false;
+
+    *dst = value;
+    return true;
+}
+
+/*
+ * Compile the style described in `str' into `style'. Returns false and prints
+ * the reason on errors.
+ */
+static bool compile_style(struct Style* style, const char* str) {
+    memset(style, 0, sizeof(struct Style));
+    style->octave_base  = 4;
+    style->octave_split = 3;
+
+    char directive[MAX_NAME];
+    char arg[MAX_NAME];
+    for (int line = 1; *str != '\0'; line++) {
+        if (next_token(&str, directive)) {
+            if (strcmp(directive, "octave") == 0) {
+                if (!next_token(&str, arg))
+                    goto missing;
+                if (!parse_int(arg, 0, 8, &style->octave_base)) {
+                    fprintf(stderr, "Style:%d: Invalid octave.\n", line);
+                    return false;
                 }
 
-                insert_note(buf, &buf_pos, godbits(4));
-                insert_note(buf, &buf_pos, godbits(4));
-                insert_note(buf, &buf_pos, godbits(4));
-            } break;
+                /* First note index in the upper octave, see `note_pitch' */
+                if (!next_token(&str, arg))
+                    goto missing;
+                if (!parse_int(arg, 0, 8, &style->octave_split)) {
+                    fprintf(stderr, "Style:%d: Invalid octave split.\n", line);
+                    return false;
+                }
+            } else if (strcmp(directive, "rests") == 0) {
+                style->use_rests = true;
+            } else if (strcmp(directive, "meter") == 0) {
+                if (style->meter_num >= MAX_METERS) {
+                    fprintf(stderr, "Style:%d: Too many meters.\n", line);
+                    return false;
+                }
+                if (!next_token(&str, arg))
+                    goto missing;
 
-            case DUR_8_16_16: {
-                if (last_duration != DUR_8_8)
-                    buf[buf_pos++] = 'e';
+                const int meter = style->meter_num;
+                if (!parse_int(arg, 1, MAX_BEATS, &style->meter_beats[meter])) {
+                    fprintf(stderr, "Style:%d: Invalid meter.\n", line);
+                    return false;
+                }
+                style->meter_num++;
+                if (!next_token(&str, style->meter_prefix[meter]))
+                    style->meter_prefix[meter][0] = '\0';
+            } else if (strcmp(directive, "pattern") == 0) {
+                if (!next_token(&str, arg))
+                    goto missing;
+                if (!compile_pattern(style, &str, arg, line))
+                    return false;
+            } else if (strcmp(directive, "simple") == 0) {
+                if (!compile_weights(style, &str, COMPLEXITY_SIMPLE, line))
+                    return false;
+            } else if (strcmp(directive, "normal") == 0) {
+                if (!compile_weights(style, &str, COMPLEXITY_NORMAL, line))
+                    return false;
+            } else if (strcmp(directive, "complex") == 0) {
+                if (!compile_weights(style, &str, COMPLEXITY_COMPLEX, line))
+                    return false;
+            } else {
+                fprintf(stderr, "Style:%d: Unknown directive '%s'.\n", line,
+                        directive);
+                return false;
+            }
 
-                insert_note(buf, &buf_pos, godbits(4));
-                buf[buf_pos++] = 's';
-                insert_note(buf, &buf_pos, godbits(4));
-                insert_note(buf, &buf_pos, godbits(4));
-                duration = DUR_16_16_16_16;
-            } break;
+            if (next_token(&str, arg)) {
+                fprintf(stderr, "Style:%d: Unexpected '%s'.\n", line, arg);
+                return false;
+            }
+        }
 
-            case DUR_16_16_8: {
-                if (last_duration != DUR_16_16_16_16)
-                    buf[buf_pos++] = 's';
+        /* Skip comments and the newline */
+        while (*str != '\0' && *str != '\n')
+            str++;
+        if (*str == '\n')
+            str++;
+        continue;
 
-                insert_note(buf, &buf_pos, godbits(4));
-                insert_note(buf, &buf_pos, godbits(4));
-                buf[buf_pos++] = 'e';
-                insert_note(buf, &buf_pos, godbits(4));
-                duration = DUR_8_8;
-            } break;
+    missing:
+        fprintf(stderr, "Style:%d: Missing argument for '%s'.\n", line,
+                directive);
+        return false;
+    }
 
-            case DUR_16_16_16_16: {
-                if (last_duration != DUR_16_16_16_16)
-                    buf[buf_pos++] = 's';
+    if (style->meter_num == 0) {
+        fprintf(stderr, "Style: No meters were specified.\n");
+        return false;
+    }
 
-                const uint8_t random1 = godbits(4);
-                const uint8_t random2 = godbits(4);
-                insert_note(buf, &buf_pos, random1);
-                insert_note(buf, &buf_pos, random2);
-                insert_note(buf, &buf_pos, random1);
-                insert_note(buf, &buf_pos, random2);
-            } break;
+    return true;
+}
+
+/*
+ * Read a whole style file, and compile it into `style'.
+ */
+static bool load_style(struct Style* style, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open style file '%s'.\n", path);
+        return false;
+    }
+
+    size_t str_i  = 0;
+    size_t str_sz = 1024;
+    char* str     = malloc(str_sz);
+
+    size_t read;
+    while ((read = fread(&str[str_i], 1, str_sz - str_i - 1, fp)) > 0) {
+        str_i += read;
+        if (str_i + 1 >= str_sz) {
+            str_sz *= 2;
+            str = realloc(str, str_sz);
+        }
+    }
+    str[str_i] = '\0';
+    fclose(fp);
+
+    const bool result = compile_style(style, str);
+    free(str);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Run the bytecode of the specified pattern, writing its notes to each voice.
+ * Each note of a voice is adjusted to the simultaneous note of the voice above
+ * it, so the cost of each note is constant.
+ */
+static void run_pattern(int pattern, struct Voice* voices, int voice_num) {
+    const uint8_t* pc = &g_style.code[g_style.pattern_pc[pattern]];
+
+    for (;;) {
+        const uint8_t opcode  = pc[0];
+        const uint8_t operand = pc[1];
+        pc += 2;
+
+        switch (opcode) {
+            case OP_DUR:
+            case OP_DUR_ONCE:
+                for (int i = 0; i < voice_num; i++) {
+                    struct Voice* voice = &voices[i];
+                    if (opcode == OP_DUR && voice->dur_reg == operand)
+                        continue;
 
-            default: {
-                if (last_duration != DUR_4)
-                    buf[buf_pos++] = 'q';
+                    const char* duration = g_style.durations[operand];
+                    while (*duration != '\0')
+                        voice->buf[voice->buf_pos++] = *duration++;
+                    voice->dur_reg = operand;
+                }
+                break;
+
+            case OP_NOTE: {
+                int upper = -1;
+                for (int i = 0; i < voice_num; i++) {
+                    struct Voice* voice = &voices[i];
+
+                    uint64_t random = godbits(4);
+                    if (i > 0)
+                        random = harmonize(i, upper, random);
 
-                insert_note(buf, &buf_pos, godbits(4));
+                    voice->slots[operand] = random;
+                    upper                 = insert_note(voice, random);
+                }
             } break;
+
+            case OP_REPEAT:
+                for (int i = 0; i < voice_num; i++)
+                    insert_note(&voices[i], voices[i].slots[operand]);
+                break;
+
+            case OP_END:
+            default:
+                return;
         }
+    }
+}
 
-        last_duration = duration;
+/*
+ * Add the voices generated by `godvoices' to `g_sketch', as the staves of a
+ * song. If the song was sampled, their notes were already added to `staves'.
+ */
+static void sketch_voices(struct Voice* voices, struct SketchStaff* staves,
+                          int voice_num, bool sampled) {
+    /* Staves are written from the lowest one */
+    uint64_t hash = 0;
+    for (int i = voice_num - 1; i >= 0; i--) {
+        if (sampled)
+            staff_end(g_sketch, &staves[i]);
+        hash = sketch_staff_hash(hash, voices[i].buf, voices[i].buf_pos);
     }
 
+    char* text = sketch_add_song(g_sketch, hash, sampled);
+    if (text == NULL)
+        return;
+
+    /* Only the start of the song is shown */
+    char song[SKETCH_TEXT_SZ];
+    size_t song_len = 0;
+    for (int i = voice_num - 1; i >= 0; i--) {
+        for (int j = 0; j < voices[i].buf_pos; j++, song_len++)
+            if (song_len < sizeof(song))
+                song[song_len] = voices[i].buf[j];
+        if (i > 0 && song_len++ < sizeof(song))
+            song[song_len - 1] = '\n';
+    }
+    sketch_write_text(text, song, song_len);
+}
+
+/*
+ * Generate `voice_num' simultaneous phrases of `len' beats into `bufs'. All
+ * voices share the same beat patterns, and each one is placed one octave below
+ * the previous one. The `prefix' is written after the first octave of the last
+ * (lowest) voice. The notes are also added to `g_sketch', if any.
+ */
+static void godvoices(int len, int complexity, const char* prefix,
+                      char** bufs, int voice_num) {
+    assert(voice_num > 0 && voice_num <= MAX_VOICES &&
+           voice_num <= g_style.octave_base + 1);
+
+    /* Octave, prefix, the longest pattern for each beat, and NUL */
+    int max_chars = 0;
+    for (int i = 0; i < g_style.pattern_num; i++)
+        if (max_chars < g_style.pattern_max_chars[i])
+            max_chars = g_style.pattern_max_chars[i];
+    const int buf_sz = 2 + strlen(prefix) + max_chars * len;
+
+    /* Only the notes of the sampled songs are added to the sketch */
+    const bool sampled = g_sketch != NULL && sketch_sample(g_sketch);
+
+    /* The meter of the prefix affects all the staves */
+    int meter_top    = 0;
+    int meter_bottom = 0;
+    if (sampled && prefix[0] == 'M')
+        sketch_meter(&prefix[1], &meter_top, &meter_bottom);
+
+    struct SketchStaff staves[MAX_VOICES];
+    struct Voice voices[MAX_VOICES];
+    for (int i = 0; i < voice_num; i++) {
+        struct Voice* voice = &voices[i];
+        voice->buf          = calloc(buf_sz, sizeof(char));
+        voice->buf_pos      = 0;
+        voice->octave       = g_style.octave_base - i;
+        voice->dur_reg      = DUR_NONE;
+        voice->staff        = NULL;
+
+        if (sampled) {
+            voice->staff = &staves[i];
+            staff_init(voice->staff);
+            staff_meter(g_sketch, voice->staff, meter_top, meter_bottom);
+        }
+
+        /*
+         * FIXME: Why does he do this?
+         */
+        voice->octave_old            = voice->octave + 1;
+        voice->buf[voice->buf_pos++] = octave2char(voice->octave_old);
+        if (i == voice_num - 1)
+            for (const char* p = prefix; *p != '\0'; p++)
+                voice->buf[voice->buf_pos++] = *p;
+
+        bufs[i] = voice->buf;
+    }
+
+    for (int i = 0; i < len; i++) {
+        const uint8_t pattern = get_duration(complexity, godbits(8));
+        run_pattern(pattern, voices, voice_num);
+    }
+
+    if (g_sketch != NULL)
+        sketch_voices(voices, staves, voice_num, sampled);
+}
+
+/*
+ * Generate a phrase of `len' beats, writing `prefix' after the first octave.
+ */
+static char* godphrase(int len, int complexity, const char* prefix) {
+    char* buf;
+    godvoices(len, complexity, prefix, &buf, 1);
     return buf;
 }
 
-int main(void) {
-    FILE* dst = stdout;
+/*
+ * Get the meter prefix of the style for songs of `len' beats.
+ */
+static const char* get_meter_prefix(int len) {
+    for (int i = 0; i < g_style.meter_num; i++)
+        if (g_style.meter_beats[i] == len)
+            return g_style.meter_prefix[i];
+
+    fprintf(stderr, "Invalid song length.");
+    abort();
+}
+
+char* godsong(int len, int complexity) {
+    return godphrase(len, complexity, get_meter_prefix(len));
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Element of a song form, referencing a phrase and a variation of it.
+ */
+struct FormElement {
+    uint8_t phrase; /* Index of the phrase, 'A' is 0 */
+    int8_t shift;   /* Octave shift of the variation */
+};
+
+/*
+ * Parse a form like "AABA" or "ABACA^" into `elements', which should be able
+ * to hold `strlen(form)' elements. Each phrase letter can be followed by any
+ * number of these variation operators:
+ *   - '^', one octave higher.
+ *   - '_', one octave lower.
+ * Returns the number of elements, or -1 on errors.
+ */
+static int parse_form(const char* form, struct FormElement* elements) {
+    int element_num = 0;
+
+    while (*form != '\0') {
+        if (*form < 'A' || *form > 'Z') {
+            fprintf(stderr, "Invalid phrase in form: '%c'.\n", *form);
+            return -1;
+        }
+
+        struct FormElement* element = &elements[element_num++];
+        element->phrase             = *form++ - 'A';
+        element->shift              = 0;
+
+        for (; *form == '^' || *form == '_'; form++)
+            element->shift += (*form == '^') ? 1 : -1;
+    }
 
-    char* result = godsong(8, COMPLEXITY_SIMPLE);
-    fprintf(dst, result);
+    return element_num;
+}
+
+/*
+ * Write `phrase' to `dst', shifting its octaves by `shift'.
+ */
+static void write_shifted(FILE* dst, const char* phrase, int shift) {
+    for (; *phrase != '\0'; phrase++) {
+        int c = *phrase;
+        if (c >= '0' && c <= '9') {
+            c += shift;
+            if (c < '0')
+                c = '0';
+            else if (c > '9')
+                c = '9';
+        }
+
+        fputc(c, dst);
+    }
+}
+
+/*
+ * Write a song with the specified `form' to `dst'. Each distinct phrase is
+ * generated once, and then written each time it's referenced by the form.
+ *
+ * If `by_reference' is true, the song is written with the phrase notation
+ * supported by `song2pmx': the first occurrence of a phrase is written as
+ * "{A:...}", and the next ones as "{A}". The variation operators are kept in
+ * the references, e.g. "{A^}".
+ */
+static bool write_form(FILE* dst, const char* form, int len, int complexity,
+                       bool by_reference) {
+    struct FormElement* elements =
+      malloc(strlen(form) * sizeof(struct FormElement));
+    const int element_num = parse_form(form, elements);
+    if (element_num <= 0) {
+        free(elements);
+        return false;
+    }
+
+    /* Generate the distinct phrases, without the meter prefix */
+    char* phrases[26] = { NULL };
+    for (int i = 0; i < element_num; i++)
+        if (phrases[elements[i].phrase] == NULL)
+            phrases[elements[i].phrase] = godphrase(len, complexity, "");
+
+    fprintf(dst, "%s", get_meter_prefix(len));
+
+    bool written[26] = { false };
+    for (int i = 0; i < element_num; i++) {
+        const struct FormElement* element = &elements[i];
+        const char* phrase         = phrases[element->phrase];
+
+        if (!by_reference) {
+            write_shifted(dst, phrase, element->shift);
+            continue;
+        }
+
+        fputc('{', dst);
+        fputc('A' + element->phrase, dst);
+        for (int j = element->shift; j != 0; j += (j > 0) ? -1 : 1)
+            fputc((j > 0) ? '^' : '_', dst);
+
+        if (!written[element->phrase]) {
+            written[element->phrase] = true;
+            fprintf(dst, ":%s", phrase);
+        }
+        fputc('}', dst);
+    }
+
+    for (int i = 0; i < 26; i++)
+        free(phrases[i]);
+    free(elements);
+    return true;
+}
+
+/*
+ * Check the arguments of `godsong' and `godvoices' against the current style.
+ * Returns an error message, or NULL if they are valid.
+ */
+static const char* check_song_args(int len, int complexity, int voice_num) {
+    bool valid_len = false;
+    for (int i = 0; i < g_style.meter_num; i++)
+        if (g_style.meter_beats[i] == len)
+            valid_len = true;
+    if (!valid_len)
+        return "The current style doesn't allow that number of beats.";
+
+    if (complexity < 0 || complexity > 2 || g_style.weight_num[complexity] <= 0)
+        return "Invalid complexity for the current style.";
+
+    if (voice_num < 1 || voice_num > MAX_VOICES ||
+        voice_num > g_style.octave_base + 1)
+        return "Invalid number of voices.";
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Other programs can include this file with SONG_LIBRARY, see `songd.c' */
+#ifndef SONG_LIBRARY
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [-s STYLE] [-l LENGTH] [-c COMPLEXITY]\n"
+            "          [-v VOICES | -f FORM [-r]] [-n COUNT] [-k SKETCH]\n"
+            "Where COMPLEXITY is 0 (simple), 1 (normal) or 2 (complex).\n"
+            "With VOICES, writes that many harmonized lines, from the lowest\n"
+            "one, up to %d.\n"
+            "The FORM is a list of phrases like \"AABA\", optionally followed\n"
+            "by '^' or '_' to shift them one octave. With '-r', repeated\n"
+            "phrases are written by reference, see song2pmx.\n"
+            "Writes COUNT songs, one after the other. With '-k', adds them\n"
+            "to the SKETCH file and reports its estimates, see sketch.h.\n",
+            argv0,
+            MAX_VOICES);
+}
+
+/*
+ * Write a song with the options of `main' to `dst', followed by a newline.
+ */
+static bool write_song(FILE* dst, const char* form, bool by_reference,
+                       int len, int complexity, int voice_num) {
+    if (form != NULL) {
+        if (!write_form(dst, form, len, complexity, by_reference))
+            return false;
+        fputc('\n', dst);
+        return true;
+    }
+
+    if (voice_num > 1) {
+        char* voices[MAX_VOICES];
+        godvoices(len, complexity, get_meter_prefix(len), voices, voice_num);
+
+        /* Staves are written from the lowest one */
+        for (int i = voice_num - 1; i >= 0; i--) {
+            fprintf(dst, "%s\n", voices[i]);
+            free(voices[i]);
+        }
+        return true;
+    }
+
+    char* result = godsong(len, complexity);
+    fputs(result, dst);
     fputc('\n', dst);
 
     free(result);
+    return true;
+}
+
+/*
+ * Like `write_song', but also add the song to `sketch'. Songs with a form are
+ * added as text, since their phrases are reused; the rest are added by the
+ * generator.
+ */
+static bool write_sketched_song(FILE* dst, struct Sketch* sketch,
+                                const char* form, bool by_reference, int len,
+                                int complexity, int voice_num) {
+    if (form == NULL) {
+        g_sketch      = sketch;
+        const bool ok =
+          write_song(dst, form, by_reference, len, complexity, voice_num);
+        g_sketch = NULL;
+        return ok;
+    }
+
+    char* song;
+    size_t song_sz;
+    FILE* mem = open_memstream(&song, &song_sz);
+    if (mem == NULL) {
+        fprintf(stderr, "Could not allocate the song.\n");
+        abort();
+    }
+    const bool ok =
+      write_song(mem, form, by_reference, len, complexity, voice_num);
+    fclose(mem);
+
+    if (ok) {
+        fwrite(song, 1, song_sz, dst);
+
+        /* Without the last newline, which is not another staff */
+        if (song_sz > 0)
+            song[song_sz - 1] = '\0';
+        sketch_song(sketch, song);
+    }
+    free(song);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    FILE* dst = stdout;
+
+    const char* style_path  = NULL;
+    int len                 = 8;
+    int complexity          = COMPLEXITY_SIMPLE;
+    const char* form        = NULL;
+    bool by_reference       = false;
+    int voice_num           = 1;
+    long count              = 1;
+    const char* sketch_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:c:f:rv:n:k:h")) != -1) {
+        switch (opt) {
+            case 's':
+                style_path = optarg;
+                break;
+            case 'l':
+                len = atoi(optarg);
+                break;
+            case 'c':
+                complexity = atoi(optarg);
+                break;
+            case 'f':
+                form = optarg;
+                break;
+            case 'r':
+                by_reference = true;
+                break;
+            case 'v':
+                voice_num = atoi(optarg);
+                break;
+            case 'n':
+                count = atol(optarg);
+                break;
+            case 'k':
+                sketch_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (style_path != NULL) {
+        if (!load_style(&g_style, style_path))
+            return 1;
+    } else if (!compile_style(&g_style, default_style)) {
+        abort();
+    }
+
+    const char* error = check_song_args(len, complexity, voice_num);
+    if (error == NULL && voice_num > 1 && form != NULL)
+        error = "Invalid number of voices.";
+    if (error == NULL && count < 0)
+        error = "Invalid number of songs.";
+    if (error != NULL) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    init_harmony();
+
+    /* Random seed, used by `godbits' */
+    srand(time(NULL));
+
+    struct Sketch* sketch = (sketch_path != NULL) ? sketch_new() : NULL;
+    for (long i = 0; i < count; i++) {
+        const bool ok =
+          (sketch != NULL)
+            ? write_sketched_song(dst, sketch, form, by_reference, len,
+                                  complexity, voice_num)
+            : write_song(dst, form, by_reference, len, complexity, voice_num);
+        if (!ok)
+            return 1;
+    }
+
+    if (sketch != NULL) {
+        if (!sketch_flush(sketch, sketch_path))
+            return 1;
+        sketch_report(stderr, sketch);
+        free(sketch);
+    }
+
     return 0;
 }
+
+#endif /* SONG_LIBRARY */
@@ -0,0 +1,940 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * ============================================================================
+ *
+ * Streaming sketches of songs, used by `godsong' and `song2pmx' for measuring
+ * the diversity of what they produce without storing it.
+ *
+ * Each song is split into three streams of items: the songs themselves, their
+ * bars, and their figures (the notes of each beat). Bars and figures are
+ * identified by their notes written with explicit octave and duration, like
+ * "4eA4eB", so the same music is the same item regardless of the context it
+ * appeared in. Only one in `SKETCH_SAMPLE' songs, chosen at random, is split
+ * into its bars and figures; the rest are only hashed as a whole, which keeps
+ * the cost of the sketches low. For each stream we keep:
+ *
+ *   - A HyperLogLog, for estimating the number of distinct items. Every song
+ *     is added to it, but only the bars of the sampled songs, so it estimates
+ *     the distinct bars among them. That is only a lower bound for the whole
+ *     stream, and it can't be scaled up, but splitting every song would cost
+ *     about 20% of the generation time of `godsong'. Building with
+ *     `SKETCH_SAMPLE' defined as 1 samples every song, and then the estimate
+ *     covers the whole stream. Figures are too few for needing one.
+ *   - A Count-Min sketch, for estimating the frequency of the items of the
+ *     sampled songs. That is enough for the frequent ones.
+ *   - The items with the highest Count-Min estimate, which are the heavy
+ *     hitters of the stream.
+ *
+ * All of them are merged by adding or taking the maximum of their counters, so
+ * the sketches of different threads or processes can be combined with
+ * `sketch_merge'. The `sketch_flush' function does that with a file, so all the
+ * processes that use the same file share their sketches.
+ *
+ * Songs can be added as text with `sketch_song', or note by note with the
+ * `staff_*' functions, which is what the generator does for not reading its
+ * own output again. Phrase references (see `song2pmx') are not expanded: their
+ * notes are only counted where they are defined.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SKETCH_MAGIC   "SONGSKCH"
+#define SKETCH_VERSION 1
+
+/*
+ * Number of HyperLogLog registers, as a power of two. The standard error of the
+ * estimate is 1.04 / sqrt(registers), about 1.6%.
+ */
+#define SKETCH_HLL_BITS 12
+#define SKETCH_HLL_REGS (1 << SKETCH_HLL_BITS)
+
+/*
+ * Size of the Count-Min sketch. Estimates exceed the real count by less than
+ * e / width of the counted occurrences, with probability 1 - exp(-depth).
+ */
+#define SKETCH_CM_BITS  11
+#define SKETCH_CM_WIDTH (1 << SKETCH_CM_BITS)
+#define SKETCH_CM_DEPTH 4
+
+/*
+ * Average number of songs for each one that is split into bars and figures, and
+ * counted by the Count-Min sketches.
+ */
+#ifndef SKETCH_SAMPLE
+#define SKETCH_SAMPLE 64
+#endif
+
+/*
+ * Number of heavy hitters kept for each stream, and number of them shown by
+ * `sketch_report'.
+ */
+#define SKETCH_TOP_NUM    32
+#define SKETCH_REPORT_NUM 10
+
+/*
+ * Characters kept of each heavy hitter, for the report, and notes of each bar
+ * or figure that are kept for writing them.
+ */
+#define SKETCH_TEXT_SZ    48
+#define SKETCH_SPAN_NOTES 16
+
+/*
+ * Length of a whole note, in ticks, like in `song2pmx'.
+ */
+#define SKETCH_WHOLE_TICKS 96
+
+struct SketchStream {
+    uint64_t total;
+    uint8_t hll[SKETCH_HLL_REGS];
+
+    /* Occurrences counted by the Count-Min sketch */
+    uint64_t sampled;
+    uint64_t cm[SKETCH_CM_DEPTH][SKETCH_CM_WIDTH];
+
+    /*
+     * Heavy hitters, and index of the one with the lowest count. Their hashes
+     * and counts are apart from their text, since they are searched for most
+     * counted items.
+     */
+    uint64_t top_hash[SKETCH_TOP_NUM];
+    uint64_t top_count[SKETCH_TOP_NUM];
+    char top_text[SKETCH_TOP_NUM][SKETCH_TEXT_SZ];
+    uint32_t top_num;
+    uint32_t top_min;
+};
+
+/*
+ * The whole sketch, stored as is by `sketch_flush'.
+ */
+struct Sketch {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+
+    struct SketchStream songs;
+    struct SketchStream bars;
+    struct SketchStream figures;
+
+    /* Songs until the next counted one, see `sketch_sample' */
+    uint64_t skip;
+    uint64_t random;
+};
+
+/*
+ * Bar or figure being read. Each note is a token with the characters of its
+ * text, from the lowest byte. See `sketch_token'.
+ */
+struct SketchSpan {
+    uint64_t hash;
+    int ticks;
+    int note_num;
+    uint64_t notes[SKETCH_SPAN_NOTES];
+};
+
+/*
+ * Staff of a sampled song being added note by note. Figures hash their notes,
+ * and bars hash their figures.
+ */
+struct SketchStaff {
+    int beat_ticks;
+    int bar_ticks;
+    struct SketchSpan bar;
+    struct SketchSpan figure;
+};
+
+/*
+ * If not NULL, the songs of the program are added to this sketch, either by
+ * `godvoices' or by `convert_text'.
+ */
+static struct Sketch* g_sketch = NULL;
+
+/*----------------------------------------------------------------------------*/
+
+static inline uint64_t sketch_mix(uint64_t h) {
+    /* Finalizer of MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t sketch_step(uint64_t h, uint64_t word) {
+    h = (h ^ word) * 0x100000001B3ULL;
+    return h ^ (h >> 29);
+}
+
+static uint64_t sketch_hash(const char* str, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, str, sizeof(word));
+        h = sketch_step(h, word);
+        str += sizeof(word);
+    }
+
+    uint64_t word = 0;
+    memcpy(&word, str, len);
+    return sketch_mix(h ^ word);
+}
+
+/*
+ * Hash of a song, given the hash of the previous staves and the next one. The
+ * first staff should be hashed with zero.
+ */
+static inline uint64_t sketch_staff_hash(uint64_t song_hash, const char* staff,
+                                         size_t len) {
+    return sketch_mix(song_hash + sketch_hash(staff, len));
+}
+
+/*----------------------------------------------------------------------------*/
+
+static inline void hll_add(uint8_t* regs, uint64_t hash) {
+    const uint32_t index = hash >> (64 - SKETCH_HLL_BITS);
+
+    /* Position of the first set bit after the index, from 1 */
+    const uint64_t rest = (hash << SKETCH_HLL_BITS) |
+                          (1ULL << (SKETCH_HLL_BITS - 1));
+    const uint8_t rank = __builtin_clzll(rest) + 1;
+
+    if (regs[index] < rank)
+        regs[index] = rank;
+}
+
+static double hll_estimate(const uint8_t* regs) {
+    const double m = SKETCH_HLL_REGS;
+
+    double sum = 0;
+    int zeros  = 0;
+    for (int i = 0; i < SKETCH_HLL_REGS; i++) {
+        sum += ldexp(1.0, -regs[i]);
+        if (regs[i] == 0)
+            zeros++;
+    }
+
+    const double alpha = 0.7213 / (1 + 1.079 / m);
+    const double raw   = alpha * m * m / sum;
+
+    /* Linear counting is more precise for small cardinalities */
+    if (raw <= 2.5 * m && zeros > 0)
+        return m * log(m / zeros);
+
+    return raw;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static inline uint32_t cm_index(uint64_t hash, int row) {
+    /* Each row uses a different multiplier on the same hash */
+    static const uint64_t seeds[SKETCH_CM_DEPTH] = {
+        0x9E3779B97F4A7C15ULL,
+        0xBF58476D1CE4E5B9ULL,
+        0x94D049BB133111EBULL,
+        0xD6E8FEB86659FD93ULL,
+    };
+    return (hash * seeds[row]) >> (64 - SKETCH_CM_BITS);
+}
+
+static uint64_t cm_estimate(const struct SketchStream* stream, uint64_t hash) {
+    uint64_t min = UINT64_MAX;
+    for (int row = 0; row < SKETCH_CM_DEPTH; row++) {
+        const uint64_t count = stream->cm[row][cm_index(hash, row)];
+        if (min > count)
+            min = count;
+    }
+    return min;
+}
+
+/*
+ * Count an occurrence of the item with `hash', and return its new estimate.
+ * Only the lowest counters are incremented (conservative update), since the
+ * others already count more than the item.
+ */
+static uint64_t cm_add(struct SketchStream* stream, uint64_t hash) {
+    uint64_t* counters[SKETCH_CM_DEPTH];
+    uint64_t min = UINT64_MAX;
+    for (int row = 0; row < SKETCH_CM_DEPTH; row++) {
+        counters[row] = &stream->cm[row][cm_index(hash, row)];
+        if (min > *counters[row])
+            min = *counters[row];
+    }
+
+    for (int row = 0; row < SKETCH_CM_DEPTH; row++)
+        if (*counters[row] == min)
+            (*counters[row])++;
+    return min + 1;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void top_find_min(struct SketchStream* stream) {
+    stream->top_min = 0;
+    for (uint32_t i = 1; i < stream->top_num; i++)
+        if (stream->top_count[i] < stream->top_count[stream->top_min])
+            stream->top_min = i;
+}
+
+/*
+ * Update the heavy hitters with the `count' of an item. If the item is new,
+ * returns the buffer for its text, which should be filled by the caller.
+ */
+static char* top_update(struct SketchStream* stream, uint64_t hash,
+                        uint64_t count) {
+    char* text = NULL;
+
+    uint32_t i = 0;
+    while (i < stream->top_num && stream->top_hash[i] != hash)
+        i++;
+
+    if (i == stream->top_num) {
+        if (stream->top_num < SKETCH_TOP_NUM)
+            stream->top_num++;
+        else if (count > stream->top_count[stream->top_min])
+            i = stream->top_min;
+        else
+            return NULL;
+
+        stream->top_hash[i] = hash;
+        text                = stream->top_text[i];
+    }
+
+    stream->top_count[i] = count;
+    if (i == stream->top_min || stream->top_num < SKETCH_TOP_NUM)
+        top_find_min(stream);
+    return text;
+}
+
+/*
+ * Count an occurrence of an item of a sampled song. Returns the buffer for its
+ * text if it's a new heavy hitter, see `top_update'.
+ */
+static char* stream_count(struct SketchStream* stream, uint64_t hash) {
+    stream->sampled++;
+
+    /* Most items are rare, and they can be discarded before the search */
+    const uint64_t count = cm_add(stream, hash);
+    if (stream->top_num < SKETCH_TOP_NUM ||
+        count > stream->top_count[stream->top_min])
+        return top_update(stream, hash, count);
+    return NULL;
+}
+
+/*
+ * Add an item to a stream, counting it if its song is `sampled'. Returns the
+ * buffer for its text like `stream_count'.
+ */
+static inline char* stream_add(struct SketchStream* stream, uint64_t hash,
+                               bool sampled) {
+    stream->total++;
+    hll_add(stream->hll, hash);
+
+    if (!sampled)
+        return NULL;
+    return stream_count(stream, hash);
+}
+
+static void stream_merge(struct SketchStream* dst,
+                         const struct SketchStream* src) {
+    dst->total += src->total;
+    dst->sampled += src->sampled;
+
+    for (int i = 0; i < SKETCH_HLL_REGS; i++)
+        if (dst->hll[i] < src->hll[i])
+            dst->hll[i] = src->hll[i];
+
+    for (int row = 0; row < SKETCH_CM_DEPTH; row++)
+        for (int i = 0; i < SKETCH_CM_WIDTH; i++)
+            dst->cm[row][i] += src->cm[row][i];
+
+    /* The counts of the heavy hitters change with the merged Count-Min */
+    for (uint32_t i = 0; i < dst->top_num; i++)
+        dst->top_count[i] = cm_estimate(dst, dst->top_hash[i]);
+    top_find_min(dst);
+
+    for (uint32_t i = 0; i < src->top_num; i++) {
+        const uint64_t hash = src->top_hash[i];
+        char* text          = top_update(dst, hash, cm_estimate(dst, hash));
+        if (text != NULL)
+            memcpy(text, src->top_text[i], SKETCH_TEXT_SZ);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void sketch_init(struct Sketch* sketch) {
+    memset(sketch, 0, sizeof(*sketch));
+    memcpy(sketch->magic, SKETCH_MAGIC, sizeof(sketch->magic));
+    sketch->version = SKETCH_VERSION;
+    sketch->size    = sizeof(*sketch);
+
+    /* The samples of each process should be different */
+    sketch->skip   = 1;
+    sketch->random = sketch_mix(((uint64_t)getpid() << 32) ^
+                                (uintptr_t)sketch) | 1;
+}
+
+static struct Sketch* sketch_new(void) {
+    struct Sketch* sketch = malloc(sizeof(struct Sketch));
+    if (sketch == NULL) {
+        fprintf(stderr, "Could not allocate the sketch.\n");
+        abort();
+    }
+
+    sketch_init(sketch);
+    return sketch;
+}
+
+static bool sketch_valid(const struct Sketch* sketch) {
+    return memcmp(sketch->magic, SKETCH_MAGIC, sizeof(sketch->magic)) == 0 &&
+           sketch->version == SKETCH_VERSION &&
+           sketch->size == sizeof(*sketch);
+}
+
+/*
+ * Decide whether the next song is counted by the Count-Min sketches.
+ */
+static inline bool sketch_sample(struct Sketch* sketch) {
+    if (--sketch->skip > 0)
+        return false;
+
+    /* Gaps between 1 and twice the average, from a xorshift generator */
+    sketch->random ^= sketch->random << 13;
+    sketch->random ^= sketch->random >> 7;
+    sketch->random ^= sketch->random << 17;
+    sketch->skip = 1 + sketch->random % (2 * SKETCH_SAMPLE - 1);
+    return true;
+}
+
+static void sketch_merge(struct Sketch* dst, const struct Sketch* src) {
+    stream_merge(&dst->songs, &src->songs);
+    stream_merge(&dst->bars, &src->bars);
+    stream_merge(&dst->figures, &src->figures);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Write `len' characters of `str' into the `text' of a heavy hitter, showing
+ * staves separated by '/', like in PMX.
+ */
+static void sketch_write_text(char* text, const char* str, size_t len) {
+    size_t i = 0;
+    for (; i < len && i < SKETCH_TEXT_SZ - 4; i++)
+        text[i] = (str[i] == '\n') ? '/' : str[i];
+
+    if (i < len)
+        for (int j = 0; j < 3; j++)
+            text[i++] = '.';
+    text[i] = '\0';
+}
+
+/*
+ * Add a song with the specified hash, see `sketch_staff_hash', and whether it's
+ * `sampled', see `sketch_sample'. Returns the buffer for its text if it's a new
+ * heavy hitter, which should be filled with `sketch_write_text'.
+ */
+static inline char* sketch_add_song(struct Sketch* sketch, uint64_t hash,
+                                    bool sampled) {
+    return stream_add(&sketch->songs, hash, sampled);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * TempleOS duration, like "et", with its length in ticks. See
+ * `SKETCH_WHOLE_TICKS'. Its characters are also kept as they are placed in the
+ * tokens of `sketch_token', along with the position of the next character.
+ */
+struct SketchDuration {
+    char duration;
+    char modifier;
+    int ticks;
+    uint64_t token;
+    int token_shift;
+};
+
+/*
+ * The default duration, a quarter note.
+ */
+#define SKETCH_QUARTER \
+    { 'q', '\0', SKETCH_WHOLE_TICKS / 4, (uint64_t)'q' << 8, 16 }
+
+/*
+ * Parse a TempleOS duration, optionally followed by modifiers. Like in
+ * `sketch_song', only the last modifier is used.
+ */
+static struct SketchDuration sketch_duration(const char* str) {
+    struct SketchDuration result = SKETCH_QUARTER;
+    if (*str == '\0')
+        return result;
+
+    result.duration = *str++;
+    for (; *str == 't' || *str == '.'; str++)
+        result.modifier = *str;
+
+    result.token = (uint64_t)(uint8_t)result.duration << 8 |
+                   (uint64_t)(uint8_t)result.modifier << 16;
+    result.token_shift = (result.modifier != '\0') ? 24 : 16;
+
+    /* clang-format off */
+    switch (result.duration) {
+        case 'w': result.ticks = SKETCH_WHOLE_TICKS;      break;
+        case 'h': result.ticks = SKETCH_WHOLE_TICKS / 2;  break;
+        case 'e': result.ticks = SKETCH_WHOLE_TICKS / 8;  break;
+        case 's': result.ticks = SKETCH_WHOLE_TICKS / 16; break;
+        default:  result.ticks = SKETCH_WHOLE_TICKS / 4;  break;
+    }
+    /* clang-format on */
+
+    if (result.modifier == 't')
+        result.ticks = result.ticks * 2 / 3;
+    else if (result.modifier == '.')
+        result.ticks = result.ticks * 3 / 2;
+    return result;
+}
+
+/*
+ * Token of a note for `staff_note', with the characters of its text. Rests use
+ * '-' as their octave, and missing accidentals are '\0'.
+ */
+static inline uint64_t sketch_token(char octave,
+                                    const struct SketchDuration* duration,
+                                    char accidental, char note) {
+    uint64_t token = (uint8_t)octave | duration->token;
+    int shift      = duration->token_shift;
+
+    token |= (uint64_t)(uint8_t)accidental << shift;
+    shift += (accidental != '\0') ? 8 : 0;
+
+    return token | (uint64_t)(uint8_t)note << shift;
+}
+
+static void span_clear(struct SketchSpan* span) {
+    span->hash     = 0;
+    span->ticks    = 0;
+    span->note_num = 0;
+}
+
+/*
+ * Add a note to a span, without hashing it, see `SketchStaff'.
+ */
+static inline void span_add(struct SketchSpan* span, uint64_t token,
+                            int ticks) {
+    span->ticks += ticks;
+    if (span->note_num < SKETCH_SPAN_NOTES)
+        span->notes[span->note_num] = token;
+    span->note_num++;
+}
+
+/*
+ * Write the notes of a span into the `text' of a heavy hitter.
+ */
+static void span_write_text(const struct SketchSpan* span, char* text) {
+    char str[SKETCH_SPAN_NOTES * sizeof(uint64_t)];
+    size_t len = 0;
+    for (int i = 0; i < span->note_num && i < SKETCH_SPAN_NOTES; i++)
+        for (uint64_t token = span->notes[i]; token != 0; token >>= 8)
+            str[len++] = token & 0xFF;
+
+    /* The text was cut if there were too many notes */
+    sketch_write_text(text,
+                      str,
+                      (span->note_num > SKETCH_SPAN_NOTES) ? SIZE_MAX : len);
+}
+
+/*
+ * Ticks left after a span of `span_ticks', by notes that are longer than the
+ * rest of the span. They are counted in the next one.
+ */
+static inline int span_carry(const struct SketchSpan* span, int span_ticks) {
+    const int carry = span->ticks - span_ticks;
+    return (carry < span_ticks) ? carry : carry % span_ticks;
+}
+
+/*
+ * End the current figure of a staff, adding it to the current bar.
+ */
+static void staff_figure(struct Sketch* sketch, struct SketchStaff* staff) {
+    struct SketchSpan* figure = &staff->figure;
+    if (figure->note_num == 0)
+        return;
+
+    staff->bar.hash = sketch_step(staff->bar.hash, figure->hash);
+
+    char* text = stream_count(&sketch->figures, sketch_mix(figure->hash));
+    if (text != NULL)
+        span_write_text(figure, text);
+    span_clear(figure);
+}
+
+/*
+ * End the current bar of a staff, even if it's incomplete, along with its last
+ * figure.
+ */
+static void staff_end(struct Sketch* sketch, struct SketchStaff* staff) {
+    staff_figure(sketch, staff);
+
+    struct SketchSpan* bar = &staff->bar;
+    if (bar->note_num == 0)
+        return;
+
+    char* text = stream_add(&sketch->bars, sketch_mix(bar->hash), true);
+    if (text != NULL)
+        span_write_text(bar, text);
+    span_clear(bar);
+}
+
+/*
+ * Change the meter of a staff, which also starts a new bar.
+ */
+static void staff_meter(struct Sketch* sketch, struct SketchStaff* staff,
+                        int top, int bottom) {
+    staff_end(sketch, staff);
+    if (top <= 0 || bottom <= 0)
+        return;
+
+    /* Compound meters, like 6/8, have beats of three notes */
+    staff->beat_ticks = SKETCH_WHOLE_TICKS / bottom;
+    if (bottom >= 8 && top % 3 == 0 && top > 3)
+        staff->beat_ticks *= 3;
+    staff->bar_ticks = top * SKETCH_WHOLE_TICKS / bottom;
+}
+
+static void staff_init(struct SketchStaff* staff) {
+    staff->beat_ticks = SKETCH_WHOLE_TICKS / 4;
+    staff->bar_ticks  = SKETCH_WHOLE_TICKS;
+    span_clear(&staff->bar);
+    span_clear(&staff->figure);
+}
+
+/*
+ * Add a note to a staff, with the `token' from `sketch_token'.
+ */
+static void staff_note(struct Sketch* sketch, struct SketchStaff* staff,
+                       uint64_t token, int ticks) {
+    staff->figure.hash = sketch_step(staff->figure.hash, token);
+    span_add(&staff->figure, token, ticks);
+    span_add(&staff->bar, token, ticks);
+
+    if (staff->figure.ticks >= staff->beat_ticks) {
+        const int carry = span_carry(&staff->figure, staff->beat_ticks);
+        staff_figure(sketch, staff);
+        staff->figure.ticks = carry;
+    }
+
+    if (staff->bar.ticks >= staff->bar_ticks) {
+        const int carry = span_carry(&staff->bar, staff->bar_ticks);
+        staff_end(sketch, staff);
+        staff->bar.ticks = carry;
+    }
+}
+
+/*
+ * Parse the meter after the 'M' of a TempleOS song, like "6/8". Returns a
+ * pointer after it.
+ */
+static const char* sketch_meter(const char* str, int* top, int* bottom) {
+    if (*str >= '1' && *str <= '9')
+        *top = *str++ - '0';
+    if (*str == '/')
+        str++;
+    if (*str >= '1' && *str <= '9')
+        *bottom = *str++ - '0';
+    return str;
+}
+
+/*
+ * Hash of a song whose staves are separated by newlines, see
+ * `sketch_staff_hash'.
+ */
+static uint64_t sketch_song_hash(const char* song) {
+    uint64_t hash = 0;
+    for (;;) {
+        const char* end = strchr(song, '\n');
+        if (end == NULL)
+            return sketch_staff_hash(hash, song, strlen(song));
+
+        hash = sketch_staff_hash(hash, song, end - song);
+        song = end + 1;
+    }
+}
+
+/*
+ * Add a TempleOS song to the sketch. Staves are separated by newlines. Like in
+ * TempleOS, duration modifiers last until the next duration, and the meter
+ * until the next meter. Characters that are not part of notes, like ties and
+ * phrases, are ignored.
+ */
+static void sketch_song(struct Sketch* sketch, const char* song) {
+    /* Most songs are only hashed, see `sketch_sample' */
+    if (!sketch_sample(sketch)) {
+        sketch_add_song(sketch, sketch_song_hash(song), false);
+        return;
+    }
+
+    char octave                    = '4';
+    char accidental                = '\0';
+    struct SketchDuration duration = sketch_duration("q");
+    int meter_top                  = 4;
+    int meter_bottom               = 4;
+
+    struct SketchStaff staff;
+    staff_init(&staff);
+
+    uint64_t song_hash = 0;
+    const char* start  = song;
+
+    const char* p = song;
+    for (;;) {
+        const char c = *p++;
+        switch (c) {
+            case 'A':
+            case 'B':
+            case 'C':
+            case 'D':
+            case 'E':
+            case 'F':
+            case 'G':
+                staff_note(sketch,
+                           &staff,
+                           sketch_token(octave, &duration, accidental, c),
+                           duration.ticks);
+                accidental = '\0';
+                break;
+
+            case 'R':
+                /* Rests have no octave */
+                staff_note(sketch,
+                           &staff,
+                           sketch_token('-', &duration, '\0', c),
+                           duration.ticks);
+                break;
+
+            case '0':
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9':
+                octave = c;
+                break;
+
+            case 'w':
+            case 'h':
+            case 'q':
+            case 'e':
+            case 's':
+                /* Along with its modifiers */
+                duration = sketch_duration(p - 1);
+                while (*p == 't' || *p == '.')
+                    p++;
+                break;
+
+            case 't':
+            case '.': {
+                /* Modifiers without a duration change the current one */
+                const char str[] = { duration.duration, c, '\0' };
+                duration         = sketch_duration(str);
+            } break;
+
+            case '#':
+            case 'b':
+                accidental = c;
+                break;
+
+            case 'M':
+                p = sketch_meter(p, &meter_top, &meter_bottom);
+                staff_meter(sketch, &staff, meter_top, meter_bottom);
+                break;
+
+            case '\n':
+            case '\0':
+                /* Each staff starts a new bar */
+                staff_end(sketch, &staff);
+                song_hash = sketch_staff_hash(song_hash, start, p - 1 - start);
+                start     = p;
+                if (c == '\0') {
+                    char* text = sketch_add_song(sketch, song_hash, true);
+                    if (text != NULL)
+                        sketch_write_text(text, song, p - 1 - song);
+                    return;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Merge the sketch stored in `path', if any, into `sketch', and store the
+ * result back. The file is locked meanwhile, so processes sharing it don't lose
+ * updates. Returns false on errors.
+ */
+static bool sketch_flush(struct Sketch* sketch, const char* path) {
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open the sketch file \"%s\".\n", path);
+        return false;
+    }
+
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type   = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return false;
+        }
+    }
+
+    bool ok = true;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        struct Sketch* stored = sketch_new();
+        if (pread(fd, stored, sizeof(*stored), 0) == sizeof(*stored) &&
+            sketch_valid(stored)) {
+            sketch_merge(sketch, stored);
+        } else {
+            fprintf(stderr, "Invalid sketch file \"%s\".\n", path);
+            ok = false;
+        }
+        free(stored);
+    }
+
+    if (ok && (pwrite(fd, sketch, sizeof(*sketch), 0) != sizeof(*sketch) ||
+               ftruncate(fd, sizeof(*sketch)) != 0)) {
+        fprintf(stderr, "Could not write the sketch file \"%s\".\n", path);
+        ok = false;
+    }
+
+    /* Closing the file releases the lock */
+    close(fd);
+    return ok;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Heavy hitter being reported.
+ */
+struct SketchItem {
+    uint64_t count;
+    const char* text;
+};
+
+static int compare_items(const void* a, const void* b) {
+    const struct SketchItem* item_a = a;
+    const struct SketchItem* item_b = b;
+    if (item_a->count != item_b->count)
+        return (item_a->count < item_b->count) ? 1 : -1;
+    return strcmp(item_a->text, item_b->text);
+}
+
+/*
+ * Write the most frequent items of a stream, whose counts are multiplied by
+ * `scale' for estimating the real ones.
+ */
+static void report_stream(FILE* dst, const struct SketchStream* stream,
+                          double scale) {
+    if (stream->sampled == 0)
+        return;
+
+    struct SketchItem top[SKETCH_TOP_NUM];
+    for (uint32_t i = 0; i < stream->top_num; i++) {
+        top[i].count = stream->top_count[i];
+        top[i].text  = stream->top_text[i];
+    }
+    qsort(top, stream->top_num, sizeof(top[0]), compare_items);
+
+    /*
+     * Count-Min estimates exceed the real count by at most `error', so only
+     * items well above it are shown. The rest could be rare items that share
+     * counters, or that were only counted once.
+     */
+    const double error = exp(1.0) * stream->sampled / SKETCH_CM_WIDTH;
+
+    for (uint32_t i = 0; i < stream->top_num && i < SKETCH_REPORT_NUM; i++) {
+        if (top[i].count <= 2 * error || top[i].count < 2)
+            break;
+        fprintf(dst,
+                "  ~%12.0f %5.1f%%  %s\n",
+                top[i].count * scale,
+                100.0 * top[i].count / stream->sampled,
+                top[i].text);
+    }
+}
+
+/*
+ * Write the estimates of the sketch, and its most frequent items.
+ */
+static void sketch_report(FILE* dst, const struct Sketch* sketch) {
+    const struct SketchStream* songs = &sketch->songs;
+    const double scale =
+      (songs->sampled > 0) ? (double)songs->total / songs->sampled : 0;
+
+    fprintf(dst,
+            "Songs: %" PRIu64 ", ~%.0f distinct.\n",
+            songs->total,
+            hll_estimate(songs->hll));
+    report_stream(dst, songs, scale);
+
+    /*
+     * Only the bars and figures of the sampled songs are found, and the
+     * distinct bars among them can't be scaled up to the whole stream.
+     */
+    if (songs->sampled == songs->total) {
+        fprintf(dst,
+                "Bars: %" PRIu64 ", ~%.0f distinct.\n",
+                sketch->bars.total,
+                hll_estimate(sketch->bars.hll));
+    } else {
+        fprintf(dst,
+                "Bars: ~%.0f, distinct ones not estimated. The %" PRIu64
+                " sampled songs have ~%.0f distinct, a lower bound.\n",
+                sketch->bars.total * scale,
+                songs->sampled,
+                hll_estimate(sketch->bars.hll));
+    }
+    report_stream(dst, &sketch->bars, scale);
+
+    fprintf(dst, "Figures: ~%.0f.\n", sketch->figures.sampled * scale);
+    report_stream(dst, &sketch->figures, scale);
+}
+
+#endif /* SKETCH_H */
@@ -79,11 +79,33 @@
  *       - s: sharp, pitch is half step higher until the next bar line
  */
 
+#define _POSIX_C_SOURCE 200809L /* open_memstream(), clock_gettime() */
+
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sketch.h"
 
 /*
  * TempleOS duration specifiers. They set the current note duration.
@@ -120,8 +142,196 @@ enum EAccidentals {
 static int g_meter_top    = 4;
 static int g_meter_bottom = 4;
 
+/*
+ * Tie status of the next note. Goes from open to close, and from close to none.
+ */
+enum ETieStatus {
+    TIE_NONE  = 0,
+    TIE_CLOSE = 1,
+    TIE_OPEN  = 2,
+};
+
+/*
+ * Length of a whole note, in the ticks used for counting bars. A quarter note
+ * is 24 ticks, so triplets and dotted sixteenths are still integers.
+ */
+#define WHOLE_TICKS 96
+
+/*
+ * Bits of `ConvState.explicit', set whenever the song specifies that value.
+ */
+enum EExplicitValues {
+    EXPLICIT_OCTAVE   = (1 << 0),
+    EXPLICIT_DURATION = (1 << 1),
+    EXPLICIT_METER    = (1 << 2),
+};
+
+/*
+ * State of the conversion that persists across notes. If a TempleOS note
+ * doesn't specify the octave or duration, we need to fall back to the previous
+ * one.
+ */
+struct ConvState {
+    enum ETieStatus tie_status;
+    const char* duration;
+    int octave;
+
+    /* Length of the current duration, and position in the current bar */
+    int duration_ticks;
+    int bar_ticks;
+
+    /* Notes left in the current PMX triplet, which groups three notes */
+    int tuplet_notes;
+
+    /* Number of completed bars, and of written notes */
+    int bars;
+    int notes;
+
+    /* Added to the octave of the written notes, see `write_phrase' */
+    int octave_shift;
+
+    /* Values specified by the song since this was last cleared */
+    int explicit;
+};
+
+static struct ConvState g_state = { TIE_NONE, "", 4, 24, 0, 0, 0, 0, 0, 0 };
+
+/*
+ * Parameters used for choosing the layout of the PMX document, see
+ * `compute_layout'.
+ */
+#define LAYOUT_NOTES_PER_SYSTEM    32
+#define LAYOUT_MAX_BARS_PER_SYSTEM 8
+#define LAYOUT_SYSTEMS_PER_PAGE    10
+
+/*
+ * Maximum number of staves in a PMX document. Each line of the song is a
+ * staff.
+ */
+#define MAX_STAVES 24
+
+/*
+ * PMX clefs used for the staves.
+ */
+enum EClefs {
+    CLEF_BASS          = '0',
+    CLEF_FRENCH_VIOLIN = '7',
+};
+
+/*
+ * Staves, pages and systems of the PMX document.
+ */
+struct Layout {
+    int staves;
+    char clefs[MAX_STAVES];
+
+    int npages;
+    int nsyst;
+};
+
+/*
+ * Maximum number of cached variations of each phrase.
+ */
+#define MAX_VARIANTS 8
+
+/*
+ * Cached PMX output of a phrase, played with some octave shift.
+ *
+ * The PMX notes before `prefix_pmx' (which correspond to the TempleOS notes
+ * before `prefix_src') depend on the octave and duration that were active when
+ * the phrase started, that is, the `entry' state. If the phrase is played again
+ * with a different state, only that prefix needs to be converted again.
+ *
+ * The bars and notes of the phrase are counted by the difference between the
+ * `exit' state and the `entry' one (or the `prefix' one, after the end of the
+ * prefix), which is only valid from the same position in the bar.
+ */
+struct PhraseVariant {
+    int shift;
+
+    char* pmx;
+    size_t pmx_sz;
+
+    size_t prefix_src;
+    size_t prefix_pmx;
+
+    struct ConvState entry;
+    struct ConvState prefix;
+    struct ConvState exit;
+    int entry_meter_top, entry_meter_bottom;
+    int exit_meter_top, exit_meter_bottom;
+};
+
+/*
+ * Phrase defined with the "{A:...}" notation. The source points inside the
+ * song, and doesn't include the braces.
+ */
+struct Phrase {
+    const char* src;
+    size_t src_sz;
+
+    struct PhraseVariant variants[MAX_VARIANTS];
+    int variant_num;
+};
+
+/*
+ * Phrases of the song, from 'A' to 'Z'.
+ */
+static struct Phrase g_phrases[26];
+
+/*
+ * Are we converting the song with the editor? See `edit_song'.
+ */
+static bool g_editing = false;
+
+/*
+ * If not NULL, warnings are written here, one per line, instead of to
+ * `stderr'. See `warn'.
+ */
+static FILE* g_warnings = NULL;
+
+/*
+ * File where `g_sketch' is merged, see `sketch_flush'.
+ */
+static const char* g_sketch_path = NULL;
+
 /*----------------------------------------------------------------------------*/
 
+/*
+ * Print a warning about the song being converted.
+ */
+static void warn(const char* fmt, ...) {
+    FILE* dst = (g_warnings != NULL) ? g_warnings : stderr;
+    if (g_warnings == NULL)
+        fprintf(dst, "Warning: ");
+
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(dst, fmt, va);
+    va_end(va);
+
+    fputc('\n', dst);
+}
+
+/*
+ * Find the last of the warnings written to `g_warnings', which is the error
+ * when a conversion fails, like "Invalid note: ...". Returns its start, and
+ * stores its length in `len', which is zero if there are no warnings.
+ */
+static char* last_warning(char* warnings, size_t warnings_sz, size_t* len) {
+    char* last    = warnings;
+    *len          = 0;
+    char* warning = warnings;
+    while (warning < warnings + warnings_sz) {
+        char* newline = strchr(warning, '\n');
+        last          = warning;
+        *len          = newline - warning;
+        warning       = newline + 1;
+    }
+
+    return last;
+}
+
 static char* read_song(FILE* fp) {
     size_t str_i  = 0;
     size_t str_sz = 100;
@@ -176,6 +386,26 @@ static const char* get_pmx_duration(char c) {
     /* clang-format on */
 }
 
+/*
+ * Return the length of a TempleOS duration specifier, in ticks. See
+ * `WHOLE_TICKS'.
+ */
+static int get_duration_ticks(char c) {
+    /* clang-format off */
+    switch (c) {
+        case DURATION_WHOLE:      return WHOLE_TICKS;
+        case DURATION_HALF:       return WHOLE_TICKS / 2;
+        case DURATION_QUARTER:    return WHOLE_TICKS / 4;
+        case DURATION_EIGHTH:     return WHOLE_TICKS / 8;
+        case DURATION_SIXTEENTH:  return WHOLE_TICKS / 16;
+
+        default:
+            fprintf(stderr, "Invalid TempleOS duration specifier: '%c'.\n", c);
+            abort();
+    }
+    /* clang-format on */
+}
+
 /*----------------------------------------------------------------------------*/
 
 /*
@@ -242,30 +472,17 @@ static const char* write_note(FILE* dst, const char* song) {
     if (*song == '\0')
         return NULL;
 
-    static enum {
-        TIE_NONE  = 0,
-        TIE_CLOSE = 1,
-        TIE_OPEN  = 2,
-    } tie_status = TIE_NONE;
-
-    /*
-     * The octave and duration variables have to be static, because if a
-     * TempleOS note doesn't specify one of these values, we need to fall back
-     * to the previous one (the value needs to persist accross calls).
-     */
-    static const char* duration = "";
-    static int octave           = 4;
-
     /*
      * FIXME: In TempleOS songs, if a "triplet" is set with 't', it remains set
      * until a different note length is specified.
      */
     const char* duration_modifier = "";
     const char* accidental        = "";
+    char modifier                 = '\0';
 
     for (;;) {
         if (*song == '(') {
-            tie_status = TIE_OPEN;
+            g_state.tie_status = TIE_OPEN;
             song++;
         } else if (*song == 'M') { /* Meter specifier */
             song++;
@@ -275,6 +492,13 @@ static const char* write_note(FILE* dst, const char* song) {
                 song++;
             if (isdigit(*song))
                 g_meter_bottom = *song++ - '0';
+            g_state.explicit |= EXPLICIT_METER;
+
+            /* A new meter always starts a new bar */
+            if (g_state.bar_ticks > 0) {
+                g_state.bar_ticks = 0;
+                g_state.bars++;
+            }
 
             /* Print the new meter here */
             fprintf(dst,
@@ -286,13 +510,17 @@ static const char* write_note(FILE* dst, const char* song) {
 
             /* TODO: Shouldn't we increase `song' here? */
         } else if (isdigit(*song)) {
-            octave = *song - '0';
+            g_state.octave = *song - '0';
+            g_state.explicit |= EXPLICIT_OCTAVE;
             song++;
         } else if (is_duration_specifier(*song)) {
-            duration = get_pmx_duration(*song);
+            g_state.duration       = get_pmx_duration(*song);
+            g_state.duration_ticks = get_duration_ticks(*song);
+            g_state.explicit |= EXPLICIT_DURATION;
             song++;
         } else if (is_duration_modifier(*song)) {
             duration_modifier = get_pmx_duration_modifier(*song);
+            modifier          = *song;
             song++;
         } else if (is_accidental(*song)) {
             accidental = get_pmx_accidental(*song);
@@ -303,37 +531,429 @@ static const char* write_note(FILE* dst, const char* song) {
     }
 
     if (*song < 'A' || *song > 'G') {
-        fprintf(stderr, "Warning: Invalid note: '%c' (%#x).\n", *song, *song);
+        warn("Invalid note: '%c' (%#x).", *song, *song);
         return NULL;
     }
 
     /* Actual note. Expressed as lowercase in PMX syntax */
     const char note = tolower(*song++);
 
+    /* PMX octaves are a single digit */
+    int octave = g_state.octave + g_state.octave_shift;
+    if (octave < 0)
+        octave = 0;
+    else if (octave > 9)
+        octave = 9;
+
     /* Print the PMX note */
-    if (tie_status == TIE_OPEN)
+    if (g_state.tie_status == TIE_OPEN)
         fprintf(dst, "( ");
     fprintf(dst,
             "%c%s%d%s%s",
             note,
-            duration,
+            g_state.duration,
             octave,
             duration_modifier,
             accidental);
-    if (tie_status == TIE_CLOSE)
+    if (g_state.tie_status == TIE_CLOSE)
         fprintf(dst, " )");
     fputc(' ', dst);
 
     /* Go to next tie status: From open to close, and from close to none. */
-    if (tie_status > TIE_NONE)
-        tie_status--;
+    if (g_state.tie_status > TIE_NONE)
+        g_state.tie_status--;
+
+    /* Advance the bar position */
+    g_state.notes++;
+    int ticks = g_state.duration_ticks;
+    if (modifier == MODIFIER_DOT)
+        ticks = ticks * 3 / 2;
+
+    /* The triplet starts at the note with the modifier */
+    if (modifier == MODIFIER_TRIPLET)
+        g_state.tuplet_notes = 3;
+    if (g_state.tuplet_notes > 0) {
+        ticks = ticks * 2 / 3;
+        g_state.tuplet_notes--;
+    }
+
+    const int bar_ticks = (g_meter_bottom > 0)
+                            ? g_meter_top * WHOLE_TICKS / g_meter_bottom
+                            : WHOLE_TICKS;
+    g_state.bar_ticks += ticks;
+    while (bar_ticks > 0 && g_state.bar_ticks >= bar_ticks) {
+        g_state.bar_ticks -= bar_ticks;
+        g_state.bars++;
+    }
 
     return song;
 }
 
-static void write_pmx_header(FILE* dst) {
+static const char* write_phrase(FILE* dst, const char* song);
+
+/*
+ * Convert the next element of the song: a note, a phrase, or a staff
+ * separator. Returns a pointer to the next element, which is the end of the
+ * string if there are none left, or NULL on errors.
+ */
+static const char* write_step(FILE* dst, const char* song) {
+    while (*song != '\n' && isspace(*song))
+        song++;
+
+    if (*song == '\0')
+        return song;
+
+    /* Move to the next staff, which starts a new bar */
+    if (*song == '\n') {
+        if (g_state.bar_ticks > 0) {
+            g_state.bar_ticks = 0;
+            g_state.bars++;
+        }
+        g_state.tuplet_notes = 0;
+
+        fprintf(dst, "/\n");
+        return song + 1;
+    }
+
+    if (*song == '{')
+        return write_phrase(dst, song);
+
+    return write_note(dst, song);
+}
+
+/*
+ * Convert the song until `limit', or until the end of the string if it's NULL.
+ * Returns the pointer to the next element, or NULL if there are none left.
+ */
+static const char* write_notes(FILE* dst, const char* song,
+                               const char* limit) {
+    while (song != NULL && *song != '\0' && (limit == NULL || song < limit))
+        song = write_step(dst, song);
+
+    return (song == NULL || *song == '\0') ? NULL : song;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Free the cached variants of a phrase.
+ */
+static void clear_phrase(struct Phrase* phrase) {
+    for (int i = 0; i < phrase->variant_num; i++)
+        free(phrase->variants[i].pmx);
+    phrase->variant_num = 0;
+}
+
+/*
+ * Convert the phrase with the specified octave shift, and store the PMX output
+ * in a new variant. Returns NULL if the phrase couldn't be converted.
+ */
+static struct PhraseVariant* record_variant(struct Phrase* phrase, int shift) {
+    struct PhraseVariant* variant = &phrase->variants[phrase->variant_num];
+    variant->shift                = shift;
+    variant->prefix_src           = 0;
+    variant->prefix_pmx           = 0;
+    variant->entry                = g_state;
+    variant->prefix               = g_state;
+    variant->entry_meter_top      = g_meter_top;
+    variant->entry_meter_bottom   = g_meter_bottom;
+
+    FILE* mem = open_memstream(&variant->pmx, &variant->pmx_sz);
+    if (mem == NULL)
+        return NULL;
+
+    g_state.explicit     = 0;
+    g_state.octave_shift = shift;
+
+    const char* song  = phrase->src;
+    const char* limit = phrase->src + phrase->src_sz;
+    while (song != NULL && song < limit) {
+        song = write_step(mem, song);
+
+        /* Notes written until both values are set depend on the entry state */
+        if ((g_state.explicit & (EXPLICIT_OCTAVE | EXPLICIT_DURATION)) !=
+            (EXPLICIT_OCTAVE | EXPLICIT_DURATION)) {
+            variant->prefix_src = (song == NULL) ? phrase->src_sz
+                                                 : (size_t)(song - phrase->src);
+            variant->prefix_pmx = ftell(mem);
+            variant->prefix     = g_state;
+        }
+    }
+
+    fclose(mem);
+
+    g_state.octave_shift       = 0;
+    variant->exit              = g_state;
+    variant->exit_meter_top    = g_meter_top;
+    variant->exit_meter_bottom = g_meter_bottom;
+
+    if (song == NULL) {
+        free(variant->pmx);
+        return NULL;
+    }
+
+    phrase->variant_num++;
+    return variant;
+}
+
+/*
+ * Convert the source of a phrase after `offset' without using its variants.
+ * Returns false if the phrase couldn't be converted.
+ */
+static bool convert_phrase(FILE* dst, const struct Phrase* phrase,
+                           size_t offset, int shift) {
+    g_state.octave_shift = shift;
+    const char* song =
+      write_notes(dst, phrase->src + offset, phrase->src + phrase->src_sz);
+    g_state.octave_shift = 0;
+    return song != NULL;
+}
+
+/*
+ * Is the position in the bar the same as in `state'? See `PhraseVariant'.
+ */
+static inline bool same_bar_position(const struct ConvState* state) {
+    return state->bar_ticks == g_state.bar_ticks &&
+           state->tuplet_notes == g_state.tuplet_notes;
+}
+
+/*
+ * Write a phrase to `dst' with the specified octave shift. The PMX output of
+ * each variant is only converted once, and then copied as long as the
+ * conversion state when the phrase starts allows it. Returns false if the
+ * phrase couldn't be converted.
+ */
+static bool play_phrase(FILE* dst, struct Phrase* phrase, int shift) {
+    /* Ties crossing the phrase boundary are not cached */
+    if (g_state.tie_status != TIE_NONE)
+        return convert_phrase(dst, phrase, 0, shift);
+
+    struct PhraseVariant* variant = NULL;
+    for (int i = 0; i < phrase->variant_num; i++) {
+        if (phrase->variants[i].shift == shift) {
+            variant = &phrase->variants[i];
+            break;
+        }
+    }
+
+    if (variant == NULL) {
+        if (phrase->variant_num >= MAX_VARIANTS)
+            clear_phrase(phrase);
+
+        /* Recording converts the phrase, so the state is already correct */
+        variant = record_variant(phrase, shift);
+        if (variant == NULL)
+            return false;
+
+        fwrite(variant->pmx, 1, variant->pmx_sz, dst);
+        return true;
+    }
+
+    /* The bars would be counted differently */
+    if (!same_bar_position(&variant->entry) ||
+        variant->entry_meter_top != g_meter_top ||
+        variant->entry_meter_bottom != g_meter_bottom)
+        return convert_phrase(dst, phrase, 0, shift);
+
+    size_t pmx_start              = 0;
+    const struct ConvState* start = &variant->entry;
+    if (variant->entry.octave != g_state.octave ||
+        strcmp(variant->entry.duration, g_state.duration) != 0) {
+        /* Patch the notes that depend on the entry state */
+        g_state.octave_shift = shift;
+        write_notes(dst, phrase->src, phrase->src + variant->prefix_src);
+        g_state.octave_shift = 0;
+
+        /* The whole phrase was converted again */
+        if (variant->prefix_src >= phrase->src_sz)
+            return true;
+
+        /* A different duration can move the rest of the phrase in the bar */
+        if (!same_bar_position(&variant->prefix))
+            return convert_phrase(dst, phrase, variant->prefix_src, shift);
+
+        pmx_start = variant->prefix_pmx;
+        start     = &variant->prefix;
+    }
+
+    fwrite(&variant->pmx[pmx_start], 1, variant->pmx_sz - pmx_start, dst);
+
+    g_state.bars += variant->exit.bars - start->bars;
+    g_state.notes += variant->exit.notes - start->notes;
+    g_state.bar_ticks      = variant->exit.bar_ticks;
+    g_state.tuplet_notes   = variant->exit.tuplet_notes;
+    g_state.duration_ticks = variant->exit.duration_ticks;
+
+    g_state.tie_status = variant->exit.tie_status;
+    g_state.duration   = variant->exit.duration;
+    g_state.octave     = variant->exit.octave;
+    if (variant->exit.explicit & EXPLICIT_METER) {
+        g_meter_top    = variant->exit_meter_top;
+        g_meter_bottom = variant->exit_meter_bottom;
+    }
+
+    return true;
+}
+
+/*
+ * Write the phrase at `song', which can be a definition like "{A:...}", or a
+ * reference to a previous phrase like "{A}". Both can be followed by the
+ * variation operators '^' and '_', to play it one octave higher or lower.
+ * Returns a pointer after the phrase, or NULL on errors.
+ */
+static const char* write_phrase(FILE* dst, const char* song) {
+    static bool in_phrase = false;
+    if (g_editing) {
+        warn("Phrases are not supported when editing.");
+        return NULL;
+    }
+    if (in_phrase) {
+        warn("Phrases can't be nested.");
+        return NULL;
+    }
+
+    song++;
+    if (*song < 'A' || *song > 'Z') {
+        warn("Invalid phrase: '%c' (%#x).", *song, *song);
+        return NULL;
+    }
+
+    const char name       = *song++;
+    struct Phrase* phrase = &g_phrases[name - 'A'];
+
+    int shift = 0;
+    for (; *song == '^' || *song == '_'; song++)
+        shift += (*song == '^') ? 1 : -1;
+
+    if (*song == ':') {
+        song++;
+
+        const char* end = strchr(song, '}');
+        if (end == NULL) {
+            warn("Unterminated phrase '%c'.", name);
+            return NULL;
+        }
+
+        clear_phrase(phrase);
+        phrase->src    = song;
+        phrase->src_sz = end - song;
+        song           = end;
+    } else if (phrase->src == NULL) {
+        warn("Undefined phrase '%c'.", name);
+        return NULL;
+    }
+
+    if (*song != '}') {
+        warn("Invalid phrase reference '%c'.", name);
+        return NULL;
+    }
+    song++;
+
+    in_phrase         = true;
+    const bool played = play_phrase(dst, phrase, shift);
+    in_phrase         = false;
+
+    return played ? song : NULL;
+}
+
+/*
+ * Is the character at `p' an octave, and not a digit of a meter specifier like
+ * "M6/8"? The characters before `start' are not checked.
+ */
+static inline bool is_octave(const char* start, const char* p) {
+    return isdigit(*p) && (p == start || (p[-1] != 'M' && p[-1] != '/'));
+}
+
+/*
+ * Clef of a staff whose notes have the specified octaves. Staves whose notes
+ * are mostly below the fourth octave use the bass clef.
+ */
+static inline char staff_clef(int octave_sum, int octave_num) {
+    return (octave_num > 0 && octave_sum < 4 * octave_num) ? CLEF_BASS
+                                                           : CLEF_FRENCH_VIOLIN;
+}
+
+/*
+ * Fill the staves of the layout, one for each non-empty line of the song, with
+ * the clef from `staff_clef'.
+ */
+static void scan_staves(const char* song, struct Layout* layout) {
+    layout->staves = 0;
+
+    bool empty     = true;
+    int octave_sum = 0;
+    int octave_num = 0;
+    for (const char* p = song;; p++) {
+        if (*p == '\n' || *p == '\0') {
+            if (!empty && layout->staves < MAX_STAVES) {
+                layout->clefs[layout->staves++] =
+                  staff_clef(octave_sum, octave_num);
+            } else if (!empty) {
+                warn("Too many staves.");
+            }
+
+            if (*p == '\0')
+                break;
+
+            empty      = true;
+            octave_sum = 0;
+            octave_num = 0;
+            continue;
+        }
+
+        if (!isspace(*p))
+            empty = false;
+
+        if (is_octave(song, p)) {
+            octave_sum += *p - '0';
+            octave_num++;
+        }
+    }
+
+    if (layout->staves == 0) {
+        layout->staves   = 1;
+        layout->clefs[0] = CLEF_FRENCH_VIOLIN;
+    }
+}
+
+/*
+ * Choose the number of pages and systems of a song with the specified number of
+ * bars and notes, adding up all staves. Denser bars get fewer bars per system,
+ * and the number of systems per page is fixed, so the spacing done by `pmxab'
+ * and `musixflx' for each system is bounded, and the total work grows linearly
+ * with the song.
+ */
+static void compute_layout(struct Layout* layout, int bars, int notes) {
+    layout->npages = 1;
+    layout->nsyst  = 1;
+    if (bars <= 0)
+        return;
+
+    const int notes_per_bar = (notes + bars - 1) / bars;
+
+    /* The staves are played at the same time */
+    bars = (bars + layout->staves - 1) / layout->staves;
+
+    int bars_per_system = LAYOUT_NOTES_PER_SYSTEM;
+    if (notes_per_bar > 0)
+        bars_per_system /= notes_per_bar;
+    if (bars_per_system < 1)
+        bars_per_system = 1;
+    else if (bars_per_system > LAYOUT_MAX_BARS_PER_SYSTEM)
+        bars_per_system = LAYOUT_MAX_BARS_PER_SYSTEM;
+
+    /* Each staff makes the systems taller */
+    int systems_per_page = LAYOUT_SYSTEMS_PER_PAGE / layout->staves;
+    if (systems_per_page < 1)
+        systems_per_page = 1;
+
+    layout->nsyst  = (bars + bars_per_system - 1) / bars_per_system;
+    layout->npages = (layout->nsyst + systems_per_page - 1) / systems_per_page;
+}
+
+static void write_pmx_header(FILE* dst, const struct Layout* layout) {
     /* Staves and instruments: nv, noinst */
-    fprintf(dst, "1 1 ");
+    fprintf(dst, "%d %d ", layout->staves, layout->staves);
 
     /* Meter: mtrnuml, mtrdenl, mtrnmp, mtrdnp */
     fprintf(dst,
@@ -346,45 +966,1866 @@ static void write_pmx_header(FILE* dst) {
     /* xmtrnum0, isig */
     fprintf(dst, "0 0\n");
 
-    /*
-     * TODO: Improve.
-     * npages, nsyst, musicsize, fracindent
-     */
-    fprintf(dst, "0 4 20 0\n");
+    /* npages, nsyst, musicsize, fracindent */
+    fprintf(dst, "%d %d 20 0\n", layout->npages, layout->nsyst);
 
-    /* Instrument name: Blank */
-    fprintf(dst, "\n");
+    /* Instrument names, starting with the bottom one: Blank */
+    for (int i = 0; i < layout->staves; i++)
+        fprintf(dst, "\n");
 
-    /* Clef */
-    fprintf(dst, "7\n");
+    /* Clefs, starting with the bottom staff */
+    fprintf(dst, "%.*s\n", layout->staves, layout->clefs);
 
     /* Output path */
     fprintf(dst, "./\n\n");
 }
 
-/*----------------------------------------------------------------------------*/
+/*
+ * Reset the conversion state, so a new song can be converted.
+ */
+static void reset_conversion(void) {
+    for (size_t i = 0; i < sizeof(g_phrases) / sizeof(g_phrases[0]); i++) {
+        clear_phrase(&g_phrases[i]);
+        g_phrases[i].src = NULL;
+    }
 
-int main(void) {
-    FILE* src = stdin;
-    FILE* dst = stdout;
+    g_state.tie_status     = TIE_NONE;
+    g_state.duration       = "";
+    g_state.octave         = 4;
+    g_state.duration_ticks = WHOLE_TICKS / 4;
+    g_state.bar_ticks      = 0;
+    g_state.tuplet_notes   = 0;
+    g_state.bars           = 0;
+    g_state.notes          = 0;
+    g_state.octave_shift   = 0;
+    g_state.explicit       = 0;
 
-    /* Read the song into an allocated string */
-    char* song            = read_song(src);
-    const char* next_note = song;
+    g_meter_top    = 4;
+    g_meter_bottom = 4;
+}
 
-    /* Write the PMX header and body */
-    write_pmx_header(dst);
-    while (next_note != NULL) {
-        next_note = write_note(dst, next_note);
+/*
+ * Convert the TempleOS song in `song' into a PMX document in `dst', starting
+ * with the current meter. Returns false if the song couldn't be converted
+ * entirely, in which case the document only has the notes before the error.
+ */
+static bool convert_text(const char* song, FILE* dst) {
+    const int meter_top    = g_meter_top;
+    const int meter_bottom = g_meter_bottom;
 
-        /* Move to the next staff */
-        while (next_note != NULL && *next_note == '\n') {
-            fprintf(dst, "/\n");
-            next_note++;
-        }
+    /* Convert the body first, since the header depends on its length */
+    char* body;
+    size_t body_sz;
+    FILE* mem = open_memstream(&body, &body_sz);
+    if (mem == NULL) {
+        fprintf(stderr, "Could not allocate the PMX body.\n");
+        abort();
     }
+    const char* next = song;
+    while (next != NULL && *next != '\0')
+        next = write_step(mem, next);
+    fclose(mem);
+
+    if (g_sketch != NULL)
+        sketch_song(g_sketch, song);
+
+    /* The last bar might be incomplete */
+    const int bars = g_state.bars + ((g_state.bar_ticks > 0) ? 1 : 0);
+
+    struct Layout layout;
+    scan_staves(song, &layout);
+    compute_layout(&layout, bars, g_state.notes);
+
+    /* The header uses the initial meter */
+    g_meter_top    = meter_top;
+    g_meter_bottom = meter_bottom;
+
+    write_pmx_header(dst, &layout);
+    fwrite(body, 1, body_sz, dst);
     fputc('\n', dst);
 
+    reset_conversion();
+    free(body);
+    return next != NULL;
+}
+
+/*
+ * Convert the whole TempleOS song in `src' into a PMX document in `dst'.
+ * Returns false if it couldn't be converted, see `convert_text'.
+ */
+static bool convert_song(FILE* src, FILE* dst) {
+    /* Read the song into an allocated string */
+    char* song           = read_song(src);
+    const bool converted = convert_text(song, dst);
     free(song);
-    return 0;
+    return converted;
 }
+
+/*
+ * Merge `g_sketch' into its file, and start a new one, since its songs are
+ * already stored. Used by the processes that don't report it.
+ */
+static void flush_sketch(void) {
+    if (g_sketch == NULL || g_sketch->songs.total == 0)
+        return;
+
+    sketch_flush(g_sketch, g_sketch_path);
+    sketch_init(g_sketch);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Size of the text that the editor copies from the piece table for converting
+ * it, and minimum distance from the current note to the end of the copy. No
+ * note should be longer than `EDIT_MARGIN'.
+ */
+#define EDIT_WINDOW (64 * 1024)
+#define EDIT_MARGIN 256
+
+/*
+ * Conversion state when a chunk starts. The meter is global, so it's stored
+ * separately from the `ConvState'.
+ */
+struct EntryState {
+    struct ConvState conv;
+    int meter_top, meter_bottom;
+};
+
+/*
+ * Span of the original or added text of a `PieceTable'.
+ */
+struct Piece {
+    bool added;
+    size_t start;
+    size_t len;
+};
+
+/*
+ * Text of the song being edited. The original text is never modified, and
+ * inserted text is appended to `add'.
+ */
+struct PieceTable {
+    char* orig;
+
+    char* add;
+    size_t add_sz, add_cap;
+
+    struct Piece* pieces;
+    size_t piece_num, piece_cap;
+
+    size_t len;
+};
+
+/*
+ * Span of the song that starts at a line or at a bar, and ends at the next
+ * one, along with its PMX output.
+ */
+struct Chunk {
+    size_t src_len;
+    struct EntryState entry;
+
+    /* Bars completed and notes written in this chunk */
+    int bars;
+    int notes;
+
+    char* pmx;
+    size_t pmx_sz;
+};
+
+struct Editor {
+    struct PieceTable text;
+
+    struct Chunk* chunks;
+    size_t chunk_num, chunk_cap;
+
+    /* State at the start and the end of the song */
+    struct EntryState initial;
+    struct EntryState final;
+
+    /* Copy of the text in [window_start, window_start + window_len) */
+    char* window;
+    size_t window_start, window_len;
+};
+
+static void save_entry(struct EntryState* entry) {
+    entry->conv         = g_state;
+    entry->meter_top    = g_meter_top;
+    entry->meter_bottom = g_meter_bottom;
+}
+
+static void restore_entry(const struct EntryState* entry) {
+    g_state        = entry->conv;
+    g_meter_top    = entry->meter_top;
+    g_meter_bottom = entry->meter_bottom;
+}
+
+/*
+ * Would converting the same text from both states produce the same output?
+ *
+ * The bar position is compared too, since it decides where the chunks end and
+ * how many bars they complete, which the layout of the header depends on.
+ */
+static bool entry_equal(const struct EntryState* a,
+                        const struct EntryState* b) {
+    return a->conv.tie_status == b->conv.tie_status &&
+           strcmp(a->conv.duration, b->conv.duration) == 0 &&
+           a->conv.octave == b->conv.octave &&
+           a->conv.duration_ticks == b->conv.duration_ticks &&
+           a->conv.bar_ticks == b->conv.bar_ticks &&
+           a->conv.tuplet_notes == b->conv.tuplet_notes &&
+           a->conv.octave_shift == b->conv.octave_shift &&
+           a->meter_top == b->meter_top && a->meter_bottom == b->meter_bottom;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Make sure that a piece starts at `pos', splitting the piece that contains it
+ * if necessary, and return its index.
+ */
+static size_t pt_split(struct PieceTable* pt, size_t pos) {
+    size_t i;
+    for (i = 0; i < pt->piece_num; i++) {
+        if (pos == 0)
+            return i;
+        if (pos < pt->pieces[i].len)
+            break;
+        pos -= pt->pieces[i].len;
+    }
+
+    if (i >= pt->piece_num)
+        return pt->piece_num;
+
+    if (pt->piece_num >= pt->piece_cap) {
+        pt->piece_cap = (pt->piece_cap == 0) ? 16 : pt->piece_cap * 2;
+        pt->pieces = realloc(pt->pieces, pt->piece_cap * sizeof(struct Piece));
+    }
+
+    memmove(&pt->pieces[i + 1],
+            &pt->pieces[i],
+            (pt->piece_num - i) * sizeof(struct Piece));
+    pt->piece_num++;
+
+    pt->pieces[i].len = pos;
+    pt->pieces[i + 1].start += pos;
+    pt->pieces[i + 1].len -= pos;
+    return i + 1;
+}
+
+static void pt_insert(struct PieceTable* pt, size_t pos, const char* text,
+                      size_t len) {
+    if (len == 0)
+        return;
+
+    if (pt->add_sz + len > pt->add_cap) {
+        while (pt->add_sz + len > pt->add_cap)
+            pt->add_cap = (pt->add_cap == 0) ? 1024 : pt->add_cap * 2;
+        pt->add = realloc(pt->add, pt->add_cap);
+    }
+    memcpy(&pt->add[pt->add_sz], text, len);
+
+    const size_t i = pt_split(pt, pos);
+
+    /* When typing, extend the last added piece instead */
+    if (i > 0 && pt->pieces[i - 1].added &&
+        pt->pieces[i - 1].start + pt->pieces[i - 1].len == pt->add_sz) {
+        pt->pieces[i - 1].len += len;
+    } else {
+        if (pt->piece_num >= pt->piece_cap) {
+            pt->piece_cap = (pt->piece_cap == 0) ? 16 : pt->piece_cap * 2;
+            pt->pieces =
+              realloc(pt->pieces, pt->piece_cap * sizeof(struct Piece));
+        }
+
+        memmove(&pt->pieces[i + 1],
+                &pt->pieces[i],
+                (pt->piece_num - i) * sizeof(struct Piece));
+        pt->piece_num++;
+
+        pt->pieces[i].added = true;
+        pt->pieces[i].start = pt->add_sz;
+        pt->pieces[i].len   = len;
+    }
+
+    pt->add_sz += len;
+    pt->len += len;
+}
+
+static void pt_delete(struct PieceTable* pt, size_t pos, size_t len) {
+    if (len == 0)
+        return;
+
+    const size_t first = pt_split(pt, pos);
+    const size_t last  = pt_split(pt, pos + len);
+
+    memmove(&pt->pieces[first],
+            &pt->pieces[last],
+            (pt->piece_num - last) * sizeof(struct Piece));
+    pt->piece_num -= last - first;
+    pt->len -= len;
+}
+
+/*
+ * Copy `len' characters of the text, starting at `pos', into `dst'.
+ */
+static void pt_read(const struct PieceTable* pt, size_t pos, char* dst,
+                    size_t len) {
+    for (size_t i = 0; i < pt->piece_num && len > 0; i++) {
+        const struct Piece* piece = &pt->pieces[i];
+        if (pos >= piece->len) {
+            pos -= piece->len;
+            continue;
+        }
+
+        size_t n = piece->len - pos;
+        if (n > len)
+            n = len;
+
+        const char* buf = piece->added ? pt->add : pt->orig;
+        memcpy(dst, &buf[piece->start + pos], n);
+        dst += n;
+        len -= n;
+        pos = 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Return a pointer to the text at `pos', copying it from the piece table if
+ * it's not in the editor window.
+ */
+static const char* editor_text(struct Editor* ed, size_t pos) {
+    const size_t window_end = ed->window_start + ed->window_len;
+    if (pos < ed->window_start ||
+        (pos + EDIT_MARGIN > window_end && window_end < ed->text.len)) {
+        ed->window_start = pos;
+        ed->window_len   = ed->text.len - pos;
+        if (ed->window_len > EDIT_WINDOW)
+            ed->window_len = EDIT_WINDOW;
+
+        pt_read(&ed->text, pos, ed->window, ed->window_len);
+        ed->window[ed->window_len] = '\0';
+    }
+
+    return &ed->window[pos - ed->window_start];
+}
+
+/*
+ * Convert the chunk that starts at `pos' from the current state. The chunk
+ * ends after a newline, after the note that completes a bar, or when it
+ * reaches `limit', if it's not zero. Returns the length of the chunk.
+ */
+static size_t convert_chunk(struct Editor* ed, size_t pos, size_t limit,
+                            struct Chunk* chunk) {
+    save_entry(&chunk->entry);
+
+    FILE* mem = open_memstream(&chunk->pmx, &chunk->pmx_sz);
+    if (mem == NULL) {
+        fprintf(stderr, "Could not allocate the chunk output.\n");
+        abort();
+    }
+
+    const int bars  = g_state.bars;
+    const int notes = g_state.notes;
+    size_t len      = 0;
+    while (pos + len < ed->text.len) {
+        const char* song = editor_text(ed, pos + len);
+        const char* next = write_step(mem, song);
+
+        /*
+         * Invalid or missing note, or a NUL byte that ends the song like in
+         * `convert_text', so the rest of the song is not converted.
+         */
+        if (next == NULL || next == song) {
+            len = ed->text.len - pos;
+            break;
+        }
+
+        len += next - song;
+        if (next[-1] == '\n' || g_state.bars != bars ||
+            (limit != 0 && pos + len >= limit))
+            break;
+    }
+
+    fclose(mem);
+
+    chunk->bars  = g_state.bars - bars;
+    chunk->notes = g_state.notes - notes;
+    return len;
+}
+
+/*
+ * Convert the song again after an edit, starting at the chunk that contains
+ * `pos'. The edit replaced `deleted' characters with `inserted' ones. Only the
+ * chunks after the edit whose entry state changed are converted, so the
+ * conversion stops at the first one that didn't change. Returns the number of
+ * converted chunks.
+ */
+static size_t editor_update(struct Editor* ed, size_t pos, size_t deleted,
+                            size_t inserted) {
+    /*
+     * Find the chunk that contains the character before the edit, since the
+     * edit might complete the last note of that chunk.
+     */
+    size_t first     = 0;
+    size_t chunk_pos = 0;
+    while (first < ed->chunk_num &&
+           chunk_pos + ed->chunks[first].src_len < pos) {
+        chunk_pos += ed->chunks[first].src_len;
+        first++;
+    }
+
+    if (first < ed->chunk_num)
+        restore_entry(&ed->chunks[first].entry);
+    else
+        restore_entry(&ed->final);
+
+    /* The window is no longer valid */
+    ed->window_start = 0;
+    ed->window_len   = 0;
+
+    /* Converted chunks, replacing the ones from `first' to `old' */
+    struct Chunk* new_chunks = NULL;
+    size_t new_num = 0, new_cap = 0;
+
+    size_t old                = first;
+    size_t old_pos            = chunk_pos;
+    const size_t edit_end     = pos + inserted;
+    const size_t old_edit_end = pos + deleted;
+
+    size_t new_pos = chunk_pos;
+    for (;;) {
+        /* Skip the old chunks that start before the current position */
+        while (old < ed->chunk_num && old_pos + inserted < new_pos + deleted) {
+            old_pos += ed->chunks[old].src_len;
+            old++;
+        }
+
+        /* Stop if an old chunk after the edit starts here with our state */
+        if (new_pos >= edit_end && old < ed->chunk_num &&
+            old_pos >= old_edit_end &&
+            old_pos + inserted == new_pos + deleted) {
+            struct EntryState current;
+            save_entry(&current);
+            if (entry_equal(&current, &ed->chunks[old].entry))
+                break;
+        }
+
+        if (new_pos >= ed->text.len) {
+            old = ed->chunk_num;
+            save_entry(&ed->final);
+            break;
+        }
+
+        if (new_num >= new_cap) {
+            new_cap    = (new_cap == 0) ? 8 : new_cap * 2;
+            new_chunks = realloc(new_chunks, new_cap * sizeof(struct Chunk));
+        }
+
+        /*
+         * After the edit, end the chunks where the old ones did, so we can
+         * find one with the same entry state.
+         */
+        size_t limit = 0;
+        if (new_pos >= edit_end && old < ed->chunk_num) {
+            limit = old_pos + inserted - deleted;
+            if (limit <= new_pos)
+                limit += ed->chunks[old].src_len;
+        }
+
+        struct Chunk* chunk = &new_chunks[new_num++];
+        chunk->src_len      = convert_chunk(ed, new_pos, limit, chunk);
+        new_pos += chunk->src_len;
+    }
+
+    /* Replace the old chunks from `first' to `old' */
+    for (size_t i = first; i < old; i++)
+        free(ed->chunks[i].pmx);
+
+    const size_t chunk_num = ed->chunk_num - (old - first) + new_num;
+    if (chunk_num > ed->chunk_cap) {
+        while (chunk_num > ed->chunk_cap)
+            ed->chunk_cap = (ed->chunk_cap == 0) ? 64 : ed->chunk_cap * 2;
+        ed->chunks = realloc(ed->chunks, ed->chunk_cap * sizeof(struct Chunk));
+    }
+
+    memmove(&ed->chunks[first + new_num],
+            &ed->chunks[old],
+            (ed->chunk_num - old) * sizeof(struct Chunk));
+    if (new_num > 0)
+        memcpy(&ed->chunks[first], new_chunks, new_num * sizeof(struct Chunk));
+    ed->chunk_num = chunk_num;
+
+    free(new_chunks);
+    return new_num;
+}
+
+/*
+ * Write the whole PMX document of the song being edited.
+ */
+static void editor_write(struct Editor* ed, FILE* dst) {
+    struct EntryState current;
+    save_entry(&current);
+
+    int bars  = (ed->final.conv.bar_ticks > 0) ? 1 : 0;
+    int notes = 0;
+    for (size_t i = 0; i < ed->chunk_num; i++) {
+        bars += ed->chunks[i].bars;
+        notes += ed->chunks[i].notes;
+    }
+
+    /* The staves come from the whole text, like in `convert_text' */
+    char* song = malloc(ed->text.len + 1);
+    pt_read(&ed->text, 0, song, ed->text.len);
+    song[ed->text.len] = '\0';
+
+    struct Layout layout;
+    scan_staves(song, &layout);
+    compute_layout(&layout, bars, notes);
+    free(song);
+
+    restore_entry(&ed->initial);
+    write_pmx_header(dst, &layout);
+    restore_entry(&current);
+
+    for (size_t i = 0; i < ed->chunk_num; i++)
+        fwrite(ed->chunks[i].pmx, 1, ed->chunks[i].pmx_sz, dst);
+    fputc('\n', dst);
+}
+
+/*
+ * Decode the text of an insert command in place. Supports the "\n" and "\\"
+ * escapes. Returns the length of the decoded text.
+ */
+static size_t unescape_text(char* str) {
+    size_t len = 0;
+    for (const char* p = str; *p != '\0' && *p != '\n'; p++) {
+        if (*p == '\\' && p[1] == 'n') {
+            str[len++] = '\n';
+            p++;
+        } else if (*p == '\\' && p[1] == '\\') {
+            str[len++] = '\\';
+            p++;
+        } else {
+            str[len++] = *p;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Edit the song at `path' with the commands read from `src', one per line:
+ *
+ *     i <pos> <text>   Insert <text>, which supports the "\n" escape.
+ *     d <pos> <len>    Delete <len> characters.
+ *     p                Print the size of the PMX document, a newline, and
+ *                      the document itself.
+ *     q                Quit.
+ *
+ * The positions are byte offsets in the song. Each edit is answered with a line
+ * containing "ok", the number of converted chunks and the elapsed microseconds,
+ * or with "error". The song is split in chunks at each line and bar, and only
+ * the chunks affected by an edit are converted again.
+ */
+static int edit_song(const char* path, FILE* src, FILE* dst) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open '%s'.\n", path);
+        return 1;
+    }
+
+    struct Editor ed;
+    memset(&ed, 0, sizeof(ed));
+
+    size_t orig_sz = 0, orig_cap = 1024;
+    ed.text.orig   = malloc(orig_cap);
+    size_t read;
+    while ((read = fread(&ed.text.orig[orig_sz], 1, orig_cap - orig_sz, fp)) >
+           0) {
+        orig_sz += read;
+        if (orig_sz >= orig_cap) {
+            orig_cap *= 2;
+            ed.text.orig = realloc(ed.text.orig, orig_cap);
+        }
+    }
+    fclose(fp);
+
+    if (orig_sz > 0) {
+        ed.text.pieces    = malloc(16 * sizeof(struct Piece));
+        ed.text.piece_cap = 16;
+        ed.text.piece_num = 1;
+        ed.text.pieces[0] = (struct Piece){ false, 0, orig_sz };
+        ed.text.len       = orig_sz;
+    }
+
+    ed.window = malloc(EDIT_WINDOW + 1);
+    g_editing = true;
+
+    save_entry(&ed.initial);
+    save_entry(&ed.final);
+    editor_update(&ed, 0, 0, ed.text.len);
+
+    char* line      = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, src) > 0) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        char* arg        = &line[1];
+        const size_t pos = strtoul(arg, &arg, 10);
+        size_t chunks;
+
+        if (line[0] == 'q') {
+            break;
+        } else if (line[0] == 'p') {
+            char* pmx;
+            size_t pmx_sz;
+            FILE* mem = open_memstream(&pmx, &pmx_sz);
+            editor_write(&ed, mem);
+            fclose(mem);
+
+            fprintf(dst, "%zu\n", pmx_sz);
+            fwrite(pmx, 1, pmx_sz, dst);
+            fflush(dst);
+            free(pmx);
+            continue;
+        } else if (line[0] == 'i' && pos <= ed.text.len && *arg == ' ') {
+            arg++;
+            const size_t len = unescape_text(arg);
+            pt_insert(&ed.text, pos, arg, len);
+            chunks = editor_update(&ed, pos, 0, len);
+        } else if (line[0] == 'd' && pos <= ed.text.len) {
+            size_t len = strtoul(arg, NULL, 10);
+            if (len > ed.text.len - pos)
+                len = ed.text.len - pos;
+            pt_delete(&ed.text, pos, len);
+            chunks = editor_update(&ed, pos, len, 0);
+        } else {
+            fprintf(dst, "error\n");
+            fflush(dst);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const long usec = (end.tv_sec - start.tv_sec) * 1000000L +
+                          (end.tv_nsec - start.tv_nsec) / 1000L;
+        fprintf(dst, "ok %zu %ld\n", chunks, usec);
+        fflush(dst);
+    }
+
+    for (size_t i = 0; i < ed.chunk_num; i++)
+        free(ed.chunks[i].pmx);
+    free(ed.chunks);
+    free(ed.text.pieces);
+    free(ed.text.add);
+    free(ed.text.orig);
+    free(ed.window);
+    free(line);
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Extension of the songs converted in watch mode.
+ */
+#define WATCH_EXTENSION ".song"
+
+/*
+ * Time without new events before a batch of songs is converted, in
+ * milliseconds. Bursts of events are coalesced into a single batch.
+ */
+#define WATCH_DELAY 100
+
+/*
+ * Options of the watch mode.
+ */
+struct WatchOptions {
+    const char* dir;
+    int jobs;
+    bool render;
+};
+
+/*
+ * List of song names, relative to the watched directory.
+ */
+struct NameList {
+    char** names;
+    size_t num, cap;
+};
+
+static void push_name(struct NameList* list, const char* name) {
+    if (list->num >= list->cap) {
+        list->cap   = (list->cap == 0) ? 64 : list->cap * 2;
+        list->names = realloc(list->names, list->cap * sizeof(char*));
+    }
+
+    list->names[list->num++] = strdup(name);
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Sort the list and remove the duplicated names.
+ */
+static void dedup_names(struct NameList* list) {
+    if (list->num == 0)
+        return;
+
+    qsort(list->names, list->num, sizeof(char*), compare_names);
+
+    size_t unique = 1;
+    for (size_t i = 1; i < list->num; i++) {
+        if (strcmp(list->names[i], list->names[unique - 1]) == 0)
+            free(list->names[i]);
+        else
+            list->names[unique++] = list->names[i];
+    }
+    list->num = unique;
+}
+
+static void clear_names(struct NameList* list) {
+    for (size_t i = 0; i < list->num; i++)
+        free(list->names[i]);
+    list->num = 0;
+}
+
+/*
+ * Is `name' a visible file with the `WATCH_EXTENSION'?
+ */
+static bool is_song_name(const char* name) {
+    const size_t len     = strlen(name);
+    const size_t ext_len = strlen(WATCH_EXTENSION);
+    return name[0] != '.' && len > ext_len &&
+           strcmp(&name[len - ext_len], WATCH_EXTENSION) == 0;
+}
+
+/*
+ * Write the path of `name' inside `dir' into `dst', replacing the extension
+ * with `ext' if it's not NULL.
+ */
+static void song_path(char* dst, size_t dst_sz, const char* dir,
+                      const char* name, const char* ext) {
+    if (ext == NULL) {
+        snprintf(dst, dst_sz, "%s/%s", dir, name);
+        return;
+    }
+
+    const int base_len = strlen(name) - strlen(WATCH_EXTENSION);
+    snprintf(dst, dst_sz, "%s/%.*s%s", dir, base_len, name, ext);
+}
+
+/*
+ * Add the songs in the directory that don't have an up to date PMX file.
+ */
+static void scan_songs(const char* dir, struct NameList* list) {
+    DIR* dp = opendir(dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Could not open directory '%s'.\n", dir);
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dp)) != NULL) {
+        if (!is_song_name(entry->d_name))
+            continue;
+
+        char path[PATH_MAX];
+        struct stat song_st, pmx_st;
+        song_path(path, sizeof(path), dir, entry->d_name, NULL);
+        if (stat(path, &song_st) != 0 || !S_ISREG(song_st.st_mode))
+            continue;
+
+        song_path(path, sizeof(path), dir, entry->d_name, ".pmx");
+        if (stat(path, &pmx_st) == 0 && pmx_st.st_mtime >= song_st.st_mtime)
+            continue;
+
+        push_name(list, entry->d_name);
+    }
+
+    closedir(dp);
+}
+
+/*
+ * Run a command in `dir', discarding its output. Returns true if it succeeded.
+ */
+static bool run_command(const char* dir, char* const argv[]) {
+    const pid_t pid = fork();
+    if (pid < 0)
+        return false;
+
+    if (pid == 0) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+
+        if (chdir(dir) == 0)
+            execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return false;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Render the PMX file of a song into a PDF, with the same passes used by the
+ * Makefile rules.
+ */
+static bool render_song(const char* dir, const char* name) {
+    char pmx[PATH_MAX], tex[PATH_MAX];
+    const int base_len = strlen(name) - strlen(WATCH_EXTENSION);
+    snprintf(pmx, sizeof(pmx), "%.*s.pmx", base_len, name);
+    snprintf(tex, sizeof(tex), "%.*s.tex", base_len, name);
+
+    char* pmxab[]    = { "pmxab", pmx, NULL };
+    char* pdftex[]   = { "pdftex", "-interaction=batchmode", tex, NULL };
+    char* musixflx[] = { "musixflx", tex, NULL };
+
+    return run_command(dir, pmxab) && run_command(dir, pdftex) &&
+           run_command(dir, musixflx) && run_command(dir, pdftex);
+}
+
+/*
+ * Convert a song of the watched directory. The PMX file is written to a
+ * temporary file first, so readers never see a partial document. Returns true
+ * if it succeeded.
+ */
+static bool watch_convert(const struct WatchOptions* opts, const char* name) {
+    char src_path[PATH_MAX], dst_path[PATH_MAX], tmp_path[PATH_MAX];
+    song_path(src_path, sizeof(src_path), opts->dir, name, NULL);
+    song_path(dst_path, sizeof(dst_path), opts->dir, name, ".pmx");
+    song_path(tmp_path, sizeof(tmp_path), opts->dir, name, ".pmx.tmp");
+
+    FILE* src = fopen(src_path, "r");
+    if (src == NULL)
+        return false;
+
+    FILE* dst = fopen(tmp_path, "w");
+    if (dst == NULL) {
+        fclose(src);
+        return false;
+    }
+
+    const bool converted = convert_song(src, dst);
+    fclose(src);
+
+    if (fclose(dst) != 0 || !converted || rename(tmp_path, dst_path) != 0) {
+        remove(tmp_path);
+        return false;
+    }
+
+    return !opts->render || render_song(opts->dir, name);
+}
+
+/*
+ * Convert a batch of songs, split across the worker processes. Each worker
+ * converts every `jobs'-th song of the list. Returns the number of songs that
+ * couldn't be converted.
+ */
+static size_t watch_batch(const struct WatchOptions* opts,
+                          const struct NameList* list) {
+    size_t jobs = opts->jobs;
+    if (jobs > list->num)
+        jobs = list->num;
+
+    /* Small batches are not worth a fork */
+    if (jobs <= 1) {
+        size_t failed = 0;
+        for (size_t i = 0; i < list->num; i++)
+            if (!watch_convert(opts, list->names[i]))
+                failed++;
+        return failed;
+    }
+
+    fflush(NULL);
+
+    size_t failed = 0;
+    for (size_t job = 0; job < jobs; job++) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            /* Convert this part ourselves */
+            for (size_t i = job; i < list->num; i += jobs)
+                if (!watch_convert(opts, list->names[i]))
+                    failed++;
+            continue;
+        }
+
+        if (pid == 0) {
+            int child_failed = 0;
+            for (size_t i = job; i < list->num; i += jobs)
+                if (!watch_convert(opts, list->names[i]))
+                    child_failed++;
+            flush_sketch();
+            _exit(child_failed > 255 ? 255 : child_failed);
+        }
+    }
+
+    for (;;) {
+        int status;
+        if (wait(&status) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (WIFEXITED(status))
+            failed += WEXITSTATUS(status);
+    }
+
+    return failed;
+}
+
+/*
+ * Read the pending inotify events, adding the names of the modified songs to
+ * the list. If the event queue overflowed, the directory is scanned again.
+ */
+static void read_events(int fd, const struct WatchOptions* opts,
+                        struct NameList* list) {
+    /* The buffer needs to be aligned for the events */
+    static union {
+        struct inotify_event event;
+        char buf[64 * 1024];
+    } events;
+
+    for (;;) {
+        const ssize_t len = read(fd, events.buf, sizeof(events.buf));
+        if (len <= 0)
+            return;
+
+        for (char* p = events.buf; p < events.buf + len;) {
+            const struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+                scan_songs(opts->dir, list);
+            else if (event->len > 0 && is_song_name(event->name))
+                push_name(list, event->name);
+        }
+    }
+}
+
+/*
+ * Set by SIGINT and SIGTERM, for stopping `watch_songs' after the current batch.
+ */
+static volatile sig_atomic_t g_watch_stop = 0;
+
+static void stop_watching(int sig) {
+    (void)sig;
+    g_watch_stop = 1;
+}
+
+/*
+ * Keep converting the songs of a directory as they are created or modified,
+ * until interrupted. The songs that are already outdated are converted when
+ * starting. The sketch, if any, is reported when stopping.
+ */
+static int watch_songs(const struct WatchOptions* opts) {
+    const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("inotify_init1");
+        return 1;
+    }
+
+    if (inotify_add_watch(fd, opts->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(opts->dir);
+        close(fd);
+        return 1;
+    }
+
+    /* Without restarting, so the signals interrupt `poll' */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_watching;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct NameList list = { NULL, 0, 0 };
+    scan_songs(opts->dir, &list);
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (!g_watch_stop) {
+        /* Wait for the first event, and then until the burst ends */
+        while (list.num == 0 && !g_watch_stop) {
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                perror("poll");
+                return 1;
+            }
+            read_events(fd, opts, &list);
+        }
+        if (list.num == 0)
+            break;
+
+        while (poll(&pfd, 1, WATCH_DELAY) > 0)
+            read_events(fd, opts, &list);
+
+        dedup_names(&list);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const size_t failed = watch_batch(opts, &list);
+        flush_sketch();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        const long msec = (end.tv_sec - start.tv_sec) * 1000L +
+                          (end.tv_nsec - start.tv_nsec) / 1000000L;
+        fprintf(stderr,
+                "Converted %zu songs in %ld ms (%zu failed).\n",
+                list.num - failed,
+                msec,
+                failed);
+
+        clear_names(&list);
+    }
+
+    close(fd);
+    free(list.names);
+
+    /* The songs of all the batches are in the file */
+    if (g_sketch != NULL) {
+        if (!sketch_flush(g_sketch, g_sketch_path))
+            return 1;
+        sketch_report(stderr, g_sketch);
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Function call that contains the songs in HolyC sources, and the extensions of
+ * the files that are scanned.
+ */
+#define PLAY_CALL          "Play("
+#define EXTRACT_EXTENSIONS { ".ZC", ".HC" }
+
+/*
+ * State of an extraction. If `pmx_dir' is NULL, the songs are written to
+ * `dst' one per line; otherwise they are converted into PMX files in that
+ * directory, and their names are written to `dst'.
+ */
+struct Extraction {
+    FILE* dst;
+    const char* pmx_dir;
+    size_t songs;
+    size_t files;
+};
+
+/*
+ * Find the next occurrence of `PLAY_CALL' in `buf', starting at `pos'. Returns
+ * `len' if there are none.
+ *
+ * With SSE2, we compare 16 positions at a time against the first and last
+ * characters of the call, and only check the rest of it in the positions where
+ * both match.
+ */
+static size_t find_play(const char* buf, size_t len, size_t pos) {
+    const size_t call_len = sizeof(PLAY_CALL) - 1;
+    if (len < call_len)
+        return len;
+
+    const size_t last = len - call_len;
+
+#ifdef __SSE2__
+    const __m128i first_char = _mm_set1_epi8(PLAY_CALL[0]);
+    const __m128i last_char  = _mm_set1_epi8(PLAY_CALL[call_len - 1]);
+
+    for (; pos + 16 <= last + 1; pos += 16) {
+        const __m128i block_first =
+          _mm_loadu_si128((const __m128i*)&buf[pos]);
+        const __m128i block_last =
+          _mm_loadu_si128((const __m128i*)&buf[pos + call_len - 1]);
+
+        const __m128i matches =
+          _mm_and_si128(_mm_cmpeq_epi8(block_first, first_char),
+                        _mm_cmpeq_epi8(block_last, last_char));
+
+        unsigned mask = _mm_movemask_epi8(matches);
+        while (mask != 0) {
+            const unsigned bit = __builtin_ctz(mask);
+            if (memcmp(&buf[pos + bit + 1], &PLAY_CALL[1], call_len - 2) == 0)
+                return pos + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; pos <= last; pos++) {
+        const char* found = memchr(&buf[pos], PLAY_CALL[0], last + 1 - pos);
+        if (found == NULL)
+            break;
+
+        pos = found - buf;
+        if (memcmp(found, PLAY_CALL, call_len) == 0)
+            return pos;
+    }
+
+    return len;
+}
+
+/*
+ * Decode the HolyC string literal that starts after the opening quote at
+ * `*pos', advancing `*pos' after the closing quote. The decoded string is
+ * written to `dst', which should be able to hold the rest of `buf'. Returns
+ * false if the string is not terminated.
+ */
+static bool decode_string(const char* buf, size_t len, size_t* pos,
+                          char* dst) {
+    size_t i = *pos;
+    size_t j = 0;
+
+    while (i < len && buf[i] != '"') {
+        if (buf[i] == '\n')
+            return false;
+
+        if (buf[i] != '\\' || i + 1 >= len) {
+            dst[j++] = buf[i++];
+            continue;
+        }
+
+        i++;
+        switch (buf[i]) {
+            case 'n': dst[j++] = '\n'; i++; break;
+            case 'r': dst[j++] = '\r'; i++; break;
+            case 't': dst[j++] = '\t'; i++; break;
+            case '0': dst[j++] = '\0'; i++; break;
+            case 'x': {
+                int value = 0, digits = 0;
+                for (i++; i < len && digits < 2 && isxdigit(buf[i]); i++) {
+                    const char c = tolower(buf[i]);
+                    value = value * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+                    digits++;
+                }
+                dst[j++] = value;
+            } break;
+            default: /* '\\', '"', '\'' and unknown escapes */
+                dst[j++] = buf[i++];
+                break;
+        }
+    }
+
+    if (i >= len)
+        return false;
+
+    dst[j] = '\0';
+    *pos   = i + 1;
+    return true;
+}
+
+/*
+ * Write an extracted song, either as a line or as a PMX file. The `origin'
+ * is written next to the name of the PMX file.
+ */
+static void extract_song(struct Extraction* ex, const char* song,
+                         const char* origin) {
+    /* Empty songs are sometimes used for stopping the music */
+    if (*song == '\0')
+        return;
+
+    ex->songs++;
+
+    if (ex->pmx_dir == NULL) {
+        for (const char* p = song; *p != '\0'; p++)
+            if (*p != '\n' && *p != '\r')
+                fputc(*p, ex->dst);
+        fputc('\n', ex->dst);
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/song%05zu.pmx", ex->pmx_dir, ex->songs);
+
+    FILE* src = fmemopen((void*)song, strlen(song), "r");
+    FILE* dst = fopen(path, "w");
+    if (src == NULL || dst == NULL) {
+        fprintf(stderr, "Could not write '%s'.\n", path);
+        if (src != NULL)
+            fclose(src);
+        if (dst != NULL)
+            fclose(dst);
+        return;
+    }
+
+    convert_song(src, dst);
+    fclose(src);
+    fclose(dst);
+
+    fprintf(ex->dst, "song%05zu.pmx\t%s\n", ex->songs, origin);
+}
+
+/*
+ * Extract the songs of a single HolyC source file.
+ */
+static void extract_file(struct Extraction* ex, const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    const size_t len = st.st_size;
+    const char* buf  = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return;
+
+    ex->files++;
+
+    char* song      = NULL;
+    size_t line     = 1;
+    size_t line_pos = 0;
+    for (size_t pos = find_play(buf, len, 0); pos < len;
+         pos        = find_play(buf, len, pos)) {
+        /* Ignore calls like "GodPlay(" */
+        const bool is_call = (pos == 0 || !(isalnum(buf[pos - 1]) ||
+                                            buf[pos - 1] == '_'));
+
+        for (; line_pos < pos; line_pos++)
+            if (buf[line_pos] == '\n')
+                line++;
+
+        pos += sizeof(PLAY_CALL) - 1;
+        while (pos < len && (buf[pos] == ' ' || buf[pos] == '\t'))
+            pos++;
+        if (!is_call || pos >= len || buf[pos] != '"')
+            continue;
+        pos++;
+
+        if (song == NULL)
+            song = malloc(len + 1);
+        if (!decode_string(buf, len, &pos, song))
+            continue;
+
+        char origin[PATH_MAX + 32];
+        snprintf(origin, sizeof(origin), "%s:%zu", path, line);
+        extract_song(ex, song, origin);
+    }
+
+    free(song);
+    munmap((void*)buf, len);
+}
+
+/*
+ * Does `name' have one of the `EXTRACT_EXTENSIONS'?
+ */
+static bool is_source_name(const char* name) {
+    static const char* extensions[] = EXTRACT_EXTENSIONS;
+
+    const size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        const size_t ext_len = strlen(extensions[i]);
+        if (len > ext_len && strcmp(&name[len - ext_len], extensions[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Extract the songs of every HolyC source in `dir', recursively. Symbolic
+ * links and hidden files are ignored.
+ */
+static void extract_dir(struct Extraction* ex, const char* dir) {
+    DIR* dp = opendir(dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Could not open directory '%s'.\n", dir);
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dp)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+            extract_dir(ex, path);
+        else if (S_ISREG(st.st_mode) && is_source_name(entry->d_name))
+            extract_file(ex, path);
+    }
+
+    closedir(dp);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Number of result records, and bytes, after which the output is flushed. The
+ * output is also flushed when there is no more input available.
+ */
+#define RECORD_BATCH      64
+#define RECORD_FLUSH_SIZE (256 * 1024)
+
+/*
+ * Initial size of the input buffer, which grows for longer records.
+ */
+#define RECORD_INPUT_SIZE (64 * 1024)
+
+/*
+ * Span of a JSON value inside the input line. Strings don't include the quotes.
+ */
+struct JsonSpan {
+    char* ptr;
+    size_t len;
+    bool is_string;
+};
+
+/*
+ * Fields of an input record. The spans point inside the input line.
+ */
+struct Record {
+    struct JsonSpan id;
+    struct JsonSpan song;
+    struct JsonSpan meter;
+};
+
+/*
+ * Buffered input of the record mode. It's read from the file descriptor
+ * directly, so we know when no complete record is left in the buffer, see
+ * `input_ready'.
+ */
+struct RecordInput {
+    int fd;
+    char* buf;
+    size_t start, end, cap;
+};
+
+/*
+ * Buffered output of the record mode.
+ */
+struct RecordOutput {
+    int fd;
+    char* buf;
+    size_t len, cap;
+    size_t records;
+};
+
+static inline char* skip_json_space(char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+
+/*
+ * Scan the JSON string that starts after the opening quote at `p'. Returns a
+ * pointer to the closing quote, or NULL if it's not terminated.
+ */
+static char* scan_json_string(char* p) {
+    for (; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        else if (*p == '"')
+            return p;
+    }
+
+    return NULL;
+}
+
+/*
+ * Scan the JSON value at `p' into `span'. Nested objects and arrays are only
+ * skipped. Returns a pointer after the value, or NULL on errors.
+ */
+static char* scan_json_value(char* p, struct JsonSpan* span) {
+    span->ptr       = p;
+    span->is_string = false;
+
+    if (*p == '"') {
+        char* end = scan_json_string(p + 1);
+        if (end == NULL)
+            return NULL;
+
+        span->ptr       = p + 1;
+        span->len       = end - (p + 1);
+        span->is_string = true;
+        return end + 1;
+    }
+
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        for (; *p != '\0'; p++) {
+            if (*p == '"') {
+                p = scan_json_string(p + 1);
+                if (p == NULL)
+                    return NULL;
+            } else if (*p == '{' || *p == '[') {
+                depth++;
+            } else if ((*p == '}' || *p == ']') && --depth == 0) {
+                span->len = p + 1 - span->ptr;
+                return p + 1;
+            }
+        }
+        return NULL;
+    }
+
+    /* Numbers, booleans and null */
+    while (*p != '\0' && *p != ',' && *p != '}' && *p != ']' && *p != ' ' &&
+           *p != '\t' && *p != '\r' && *p != '\n')
+        p++;
+
+    span->len = p - span->ptr;
+    return (span->len > 0) ? p : NULL;
+}
+
+/*
+ * Scan a JSON object with the fields of a record. Unknown fields are ignored,
+ * and missing fields have a NULL pointer. Returns false if the line is not a
+ * valid object.
+ */
+static bool scan_record(char* line, struct Record* record) {
+    memset(record, 0, sizeof(struct Record));
+
+    char* p = skip_json_space(line);
+    if (*p++ != '{')
+        return false;
+
+    p = skip_json_space(p);
+    if (*p == '}')
+        return true;
+
+    for (;;) {
+        struct JsonSpan key, value;
+        p = skip_json_space(p);
+        if (*p != '"' || (p = scan_json_value(p, &key)) == NULL)
+            return false;
+
+        p = skip_json_space(p);
+        if (*p++ != ':')
+            return false;
+
+        p = scan_json_value(skip_json_space(p), &value);
+        if (p == NULL)
+            return false;
+
+        if (key.len == 2 && memcmp(key.ptr, "id", 2) == 0)
+            record->id = value;
+        else if (key.len == 4 && memcmp(key.ptr, "song", 4) == 0)
+            record->song = value;
+        else if (key.len == 5 && memcmp(key.ptr, "meter", 5) == 0)
+            record->meter = value;
+
+        p = skip_json_space(p);
+        if (*p == '}')
+            return true;
+        if (*p++ != ',')
+            return false;
+    }
+}
+
+/*
+ * Decode the escapes of a JSON string in place, and terminate it. Characters
+ * outside of ASCII are replaced with '?', since they can't be part of a song.
+ */
+static void decode_json_string(struct JsonSpan* span) {
+    char* src       = span->ptr;
+    char* dst       = span->ptr;
+    const char* end = span->ptr + span->len;
+
+    while (src < end) {
+        if (*src != '\\') {
+            *dst++ = *src++;
+            continue;
+        }
+
+        src++;
+        switch (*src++) {
+            case 'n': *dst++ = '\n'; break;
+            case 't': *dst++ = '\t'; break;
+            case 'r': *dst++ = '\r'; break;
+            case 'b': *dst++ = '\b'; break;
+            case 'f': *dst++ = '\f'; break;
+            case 'u': {
+                unsigned value = 0;
+                for (int i = 0; i < 4 && src < end && isxdigit(*src); i++) {
+                    const char c = tolower(*src++);
+                    value = value * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+                }
+                *dst++ = (value < 0x80) ? (char)value : '?';
+            } break;
+            default: /* '"', '\\' and '/' */
+                *dst++ = src[-1];
+                break;
+        }
+    }
+
+    *dst      = '\0';
+    span->len = dst - span->ptr;
+}
+
+static void output_reserve(struct RecordOutput* out, size_t len) {
+    if (out->len + len <= out->cap)
+        return;
+
+    while (out->len + len > out->cap)
+        out->cap = (out->cap == 0) ? RECORD_FLUSH_SIZE * 2 : out->cap * 2;
+    out->buf = realloc(out->buf, out->cap);
+}
+
+static void output_write(struct RecordOutput* out, const char* str,
+                         size_t len) {
+    output_reserve(out, len);
+    memcpy(&out->buf[out->len], str, len);
+    out->len += len;
+}
+
+static void output_str(struct RecordOutput* out, const char* str) {
+    output_write(out, str, strlen(str));
+}
+
+/*
+ * Write `str' as a quoted JSON string.
+ */
+static void output_json_string(struct RecordOutput* out, const char* str,
+                               size_t len) {
+    /* Worst case, every character is escaped with "\u00XX" */
+    output_reserve(out, len * 6 + 2);
+
+    char* dst = &out->buf[out->len];
+    *dst++    = '"';
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            *dst++ = '\\';
+            *dst++ = c;
+        } else if (c == '\n') {
+            *dst++ = '\\';
+            *dst++ = 'n';
+        } else if (c < 0x20) {
+            dst += sprintf(dst, "\\u%04x", c);
+        } else {
+            *dst++ = c;
+        }
+    }
+    *dst++ = '"';
+
+    out->len = dst - out->buf;
+}
+
+/*
+ * Write the whole output buffer. Since the writes block, a slow reader stops
+ * us from reading more records.
+ */
+static bool output_flush(struct RecordOutput* out) {
+    size_t written = 0;
+    while (written < out->len) {
+        const ssize_t result =
+          write(out->fd, &out->buf[written], out->len - written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        written += result;
+    }
+
+    out->len     = 0;
+    out->records = 0;
+    return true;
+}
+
+/*
+ * Read the next line of the input, replacing its newline with a NUL byte.
+ * Returns NULL at the end of the input. The line is valid until the next call.
+ */
+static char* input_line(struct RecordInput* in) {
+    for (;;) {
+        char* line    = &in->buf[in->start];
+        char* newline = memchr(line, '\n', in->end - in->start);
+        if (newline != NULL) {
+            *newline  = '\0';
+            in->start = newline + 1 - in->buf;
+            return line;
+        }
+
+        /* Move the partial line to the start, keeping room for a NUL byte */
+        memmove(in->buf, line, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+        if (in->end + 1 >= in->cap) {
+            in->cap *= 2;
+            in->buf = realloc(in->buf, in->cap);
+        }
+
+        const ssize_t result =
+          read(in->fd, &in->buf[in->end], in->cap - in->end - 1);
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        /* The last line might not end with a newline */
+        if (result <= 0) {
+            if (in->end == 0)
+                return NULL;
+            in->buf[in->end] = '\0';
+            in->start        = in->end;
+            return in->buf;
+        }
+        in->end += result;
+    }
+}
+
+/*
+ * Is there a complete line in the input buffer, or input available without
+ * blocking?
+ */
+static bool input_ready(const struct RecordInput* in) {
+    if (memchr(&in->buf[in->start], '\n', in->end - in->start) != NULL)
+        return true;
+
+    struct pollfd pfd = { in->fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Convert a single record, and write its result.
+ */
+static void convert_record(struct RecordOutput* out, char* line) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct Record record;
+    const bool valid = scan_record(line, &record);
+
+    output_str(out, "{\"id\":");
+    if (!valid || record.id.ptr == NULL)
+        output_str(out, "null");
+    else if (record.id.is_string)
+        output_write(out, record.id.ptr - 1, record.id.len + 2);
+    else
+        output_write(out, record.id.ptr, record.id.len);
+
+    if (!valid || record.song.ptr == NULL || !record.song.is_string) {
+        output_str(out, ",\"ok\":false,\"error\":");
+        output_str(out,
+                   valid ? "\"Missing song.\"}\n" : "\"Invalid JSON.\"}\n");
+        out->records++;
+        return;
+    }
+
+    /* The meter can be written as "6/8", "M6/8" or 6 */
+    if (record.meter.ptr != NULL) {
+        const char* p = record.meter.ptr;
+        if (*p == 'M')
+            p++;
+        if (isdigit(*p))
+            g_meter_top = *p++ - '0';
+        if (*p == '/' && isdigit(p[1]))
+            g_meter_bottom = p[1] - '0';
+    }
+
+    decode_json_string(&record.song);
+
+    char* pmx;
+    size_t pmx_sz;
+    char* warnings;
+    size_t warnings_sz;
+    FILE* pmx_fp = open_memstream(&pmx, &pmx_sz);
+    g_warnings   = open_memstream(&warnings, &warnings_sz);
+    if (pmx_fp == NULL || g_warnings == NULL) {
+        fprintf(stderr, "Could not allocate the record output.\n");
+        abort();
+    }
+
+    const bool converted = convert_text(record.song.ptr, pmx_fp);
+    fclose(pmx_fp);
+    fclose(g_warnings);
+    g_warnings = NULL;
+
+    if (!converted) {
+        size_t error_len;
+        const char* error = last_warning(warnings, warnings_sz, &error_len);
+
+        output_str(out, ",\"ok\":false,\"error\":");
+        if (error_len > 0)
+            output_json_string(out, error, error_len);
+        else
+            output_str(out, "\"Invalid song.\"");
+        output_str(out, "}\n");
+        out->records++;
+
+        free(pmx);
+        free(warnings);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const long usec = (end.tv_sec - start.tv_sec) * 1000000L +
+                      (end.tv_nsec - start.tv_nsec) / 1000L;
+
+    output_str(out, ",\"ok\":true,\"pmx\":");
+    output_json_string(out, pmx, pmx_sz);
+
+    output_str(out, ",\"warnings\":[");
+    const char* warning = warnings;
+    while (warning < warnings + warnings_sz) {
+        const char* newline = strchr(warning, '\n');
+        if (warning != warnings)
+            output_str(out, ",");
+        output_json_string(out, warning, newline - warning);
+        warning = newline + 1;
+    }
+
+    char timing[64];
+    snprintf(timing, sizeof(timing), "],\"usec\":%ld}\n", usec);
+    output_str(out, timing);
+    out->records++;
+
+    free(pmx);
+    free(warnings);
+}
+
+/*
+ * Convert the newline-delimited JSON records of `src', like:
+ *
+ *     {"id": 1, "song": "4eABqC", "meter": "6/8"}
+ *
+ * Writing one result record for each of them, like:
+ *
+ *     {"id":1,"ok":true,"pmx":"...","warnings":[],"usec":12}
+ *
+ * The output is written in batches, and the next records are not read until
+ * each batch is written.
+ */
+static int convert_records(FILE* src, FILE* dst) {
+    fflush(dst);
+
+    struct RecordOutput out = { fileno(dst), NULL, 0, 0, 0 };
+    struct RecordInput in   = { fileno(src), NULL, 0, 0, RECORD_INPUT_SIZE };
+    in.buf                  = malloc(in.cap);
+
+    char* line;
+    while ((line = input_line(&in)) != NULL) {
+        if (skip_json_space(line)[0] == '\0')
+            continue;
+
+        convert_record(&out, line);
+
+        if (out.records >= RECORD_BATCH || out.len >= RECORD_FLUSH_SIZE ||
+            !input_ready(&in)) {
+            if (!output_flush(&out)) {
+                perror("write");
+                break;
+            }
+        }
+    }
+
+    output_flush(&out);
+    free(out.buf);
+    free(in.buf);
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Other programs can include this file with SONG_LIBRARY, see `songd.c' */
+#ifndef SONG_LIBRARY
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [--edit FILE | --watch DIR [--jobs N] [--render] |\n"
+            "           --extract DIR [--pmx OUTDIR] | --records]\n"
+            "          [--sketch SKETCH]\n"
+            "Converts the TempleOS song from stdin into PMX. With '--edit',\n"
+            "edits the song in FILE with the commands from stdin. With\n"
+            "'--watch', converts the " WATCH_EXTENSION " files of DIR as they\n"
+            "change, and renders them into PDF files with '--render'. With\n"
+            "'--extract', writes the songs of the Play() calls in the HolyC\n"
+            "sources of DIR, one per line, or converts them into OUTDIR.\n"
+            "With '--records', converts newline-delimited JSON records.\n"
+            "With '--sketch', adds the converted songs to the SKETCH file,\n"
+            "and reports its estimates when done, see sketch.h.\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    FILE* src = stdin;
+    FILE* dst = stdout;
+
+    struct WatchOptions watch = { NULL, 0, false };
+    const char* extract_path  = NULL;
+    const char* pmx_dir       = NULL;
+    bool records              = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--edit") == 0 && i + 1 < argc) {
+            return edit_song(argv[i + 1], src, dst);
+        } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            watch.dir = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            watch.jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--render") == 0) {
+            watch.render = true;
+        } else if (strcmp(argv[i], "--extract") == 0 && i + 1 < argc) {
+            extract_path = argv[++i];
+        } else if (strcmp(argv[i], "--pmx") == 0 && i + 1 < argc) {
+            pmx_dir = argv[++i];
+        } else if (strcmp(argv[i], "--records") == 0) {
+            records = true;
+        } else if (strcmp(argv[i], "--sketch") == 0 && i + 1 < argc) {
+            g_sketch_path = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (g_sketch_path != NULL)
+        g_sketch = sketch_new();
+
+    if (watch.dir != NULL) {
+        if (watch.jobs <= 0)
+            watch.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        return watch_songs(&watch);
+    }
+
+    int ret = 0;
+    if (records) {
+        ret = convert_records(src, dst);
+    } else if (extract_path != NULL) {
+        struct Extraction ex = { dst, pmx_dir, 0, 0 };
+
+        struct stat st;
+        if (stat(extract_path, &st) == 0 && S_ISDIR(st.st_mode))
+            extract_dir(&ex, extract_path);
+        else
+            extract_file(&ex, extract_path);
+
+        fprintf(stderr,
+                "Extracted %zu songs from %zu files.\n",
+                ex.songs,
+                ex.files);
+    } else {
+        convert_song(src, dst);
+    }
+
+    if (g_sketch != NULL) {
+        if (!sketch_flush(g_sketch, g_sketch_path))
+            return 1;
+        sketch_report(stderr, g_sketch);
+        free(g_sketch);
+    }
+
+    return ret;
+}
+
+#endif /* SONG_LIBRARY */
@@ -0,0 +1,773 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * ============================================================================
+ *
+ * Benchmarks of the hot paths of `godsong.c' and `song2pmx.c', with a local
+ * store of results.
+ *
+ * Each run is appended to the results file as a JSON line, with the commit, the
+ * CPU model, the compiler, and every sample of each benchmark in nanoseconds
+ * per operation:
+ *
+ *     {"commit":"5506d5c","time":1700000000,"cpu":"...","compiler":"gcc 14.2",
+ *      "optimized":true,"benchmarks":{"godsong/simple":[812.5,...],...}}
+ *
+ * The `compare' command estimates, for each benchmark, a bootstrap confidence
+ * interval of the ratio between the medians of two runs. A benchmark regressed
+ * if the whole interval is above the threshold, so noisy benchmarks are not
+ * flagged.
+ */
+
+#define _GNU_SOURCE /* popen() */
+#define SONG_LIBRARY
+
+#include "godsong.c"
+#include "song2pmx.c"
+
+#include <inttypes.h>
+
+/*
+ * Number of samples of each benchmark, and minimum duration of a sample in
+ * nanoseconds. The iterations of each sample are calibrated before running.
+ */
+#define BENCH_SAMPLES   30
+#define BENCH_SAMPLE_NS 5000000
+
+/*
+ * Number of bootstrap resamples, and confidence of the intervals.
+ */
+#define BENCH_RESAMPLES  4000
+#define BENCH_CONFIDENCE 0.95
+
+/*
+ * Default results file, and default regression threshold in percent.
+ */
+#define BENCH_RESULTS   "bench-results.ndjson"
+#define BENCH_THRESHOLD 2.0
+
+#define MAX_BENCHMARKS 16
+#define MAX_SAMPLES    1024
+
+/*
+ * Input of the conversion benchmarks, see `init_inputs'.
+ */
+#define BENCH_SONG_PHRASES 200
+
+struct Benchmark {
+    const char* name;
+
+    /* Run `iterations' operations, and return the number of operations */
+    size_t (*run)(size_t iterations, const void* arg);
+    const void* arg;
+};
+
+/*
+ * Samples of a benchmark, in nanoseconds per operation.
+ */
+struct BenchResult {
+    char name[MAX_NAME];
+    double samples[MAX_SAMPLES];
+    int sample_num;
+};
+
+/*
+ * Run stored in the results file.
+ */
+struct BenchRun {
+    char commit[64];
+    long long time;
+    char cpu[128];
+    char compiler[64];
+    struct BenchResult results[MAX_BENCHMARKS];
+    int result_num;
+};
+
+/* Song used by `read_song' and `write_note' */
+static char* g_bench_song;
+static size_t g_bench_song_len;
+
+/* Output of `write_note', which is rewound instead of growing */
+static char* g_bench_sink_buf;
+static FILE* g_bench_sink;
+
+/* Used by the bootstrap, so it doesn't depend on `rand' */
+static uint64_t g_bench_random = 0x9E3779B97F4A7C15ULL;
+
+/*----------------------------------------------------------------------------*/
+
+static inline int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t bench_random(void) {
+    /* xorshift64* */
+    g_bench_random ^= g_bench_random >> 12;
+    g_bench_random ^= g_bench_random << 25;
+    g_bench_random ^= g_bench_random >> 27;
+    return g_bench_random * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Keep the compiler from removing the benchmarked code.
+ */
+static volatile uintptr_t g_bench_sideeffect;
+
+/*----------------------------------------------------------------------------*/
+
+static size_t bench_godsong(size_t iterations, const void* arg) {
+    const int complexity = *(const int*)arg;
+    for (size_t i = 0; i < iterations; i++) {
+        char* song = godsong(8, complexity);
+        g_bench_sideeffect += (uintptr_t)song[1];
+        free(song);
+    }
+    return iterations;
+}
+
+static size_t bench_read_song(size_t iterations, const void* arg) {
+    (void)arg;
+    for (size_t i = 0; i < iterations; i++) {
+        FILE* fp   = fmemopen(g_bench_song, g_bench_song_len, "r");
+        char* song = read_song(fp);
+        g_bench_sideeffect += (uintptr_t)song[0];
+        free(song);
+        fclose(fp);
+    }
+    return iterations;
+}
+
+/*
+ * Each iteration converts all the notes of the song, and each note is an
+ * operation.
+ */
+static size_t bench_write_note(size_t iterations, const void* arg) {
+    (void)arg;
+    size_t notes = 0;
+    for (size_t i = 0; i < iterations; i++) {
+        rewind(g_bench_sink);
+        const char* song = g_bench_song;
+        while (song != NULL && *song != '\0') {
+            song = write_note(g_bench_sink, song);
+            notes++;
+        }
+        reset_conversion();
+    }
+    return notes;
+}
+
+static const int complexities[] = {
+    COMPLEXITY_SIMPLE,
+    COMPLEXITY_NORMAL,
+    COMPLEXITY_COMPLEX,
+};
+
+static const struct Benchmark benchmarks[] = {
+    { "godsong/simple", bench_godsong, &complexities[0] },
+    { "godsong/normal", bench_godsong, &complexities[1] },
+    { "godsong/complex", bench_godsong, &complexities[2] },
+    { "read_song", bench_read_song, NULL },
+    { "write_note", bench_write_note, NULL },
+};
+
+/*
+ * Generate the input of the conversion benchmarks. The seed is fixed, so all
+ * runs convert the same song.
+ */
+static void init_inputs(void) {
+    srand(1);
+
+    size_t cap       = 0;
+    g_bench_song     = NULL;
+    g_bench_song_len = 0;
+    for (int i = 0; i < BENCH_SONG_PHRASES; i++) {
+        char* phrase     = godsong(8, i % 3);
+        const size_t len = strlen(phrase);
+        if (g_bench_song_len + len + 1 > cap) {
+            cap          = (g_bench_song_len + len + 1) * 2;
+            g_bench_song = realloc(g_bench_song, cap);
+        }
+        memcpy(&g_bench_song[g_bench_song_len], phrase, len + 1);
+        g_bench_song_len += len;
+        free(phrase);
+    }
+
+    /* The PMX of a note is never more than 16 times longer */
+    const size_t sink_sz = g_bench_song_len * 16;
+    g_bench_sink_buf     = malloc(sink_sz);
+    g_bench_sink         = fmemopen(g_bench_sink_buf, sink_sz, "w");
+    if (g_bench_sink == NULL) {
+        perror("fmemopen");
+        exit(1);
+    }
+}
+
+/*
+ * Collect the samples of a benchmark. The number of iterations is doubled until
+ * a sample takes at least `BENCH_SAMPLE_NS', which also warms up the caches.
+ */
+static void run_benchmark(const struct Benchmark* bench, int sample_num,
+                          struct BenchResult* result) {
+    size_t iterations = 1;
+    for (;;) {
+        const int64_t start = now_ns();
+        bench->run(iterations, bench->arg);
+        if (now_ns() - start >= BENCH_SAMPLE_NS)
+            break;
+        iterations *= 2;
+    }
+
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+    result->sample_num = sample_num;
+    for (int i = 0; i < sample_num; i++) {
+        const int64_t start = now_ns();
+        const size_t ops    = bench->run(iterations, bench->arg);
+        const int64_t end   = now_ns();
+        result->samples[i]  = (double)(end - start) / ops;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Read the first line of the output of `command' into `dst', or "unknown".
+ */
+static void read_command(const char* command, char* dst, size_t dst_sz) {
+    snprintf(dst, dst_sz, "unknown");
+
+    FILE* fp = popen(command, "r");
+    if (fp == NULL)
+        return;
+
+    if (fgets(dst, dst_sz, fp) != NULL)
+        dst[strcspn(dst, "\n")] = '\0';
+    if (pclose(fp) != 0 || dst[0] == '\0')
+        snprintf(dst, dst_sz, "unknown");
+}
+
+static void read_cpu_model(char* dst, size_t dst_sz) {
+    snprintf(dst, dst_sz, "unknown");
+
+    FILE* fp = fopen("/proc/cpuinfo", "r");
+    if (fp == NULL)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "model name", 10) != 0)
+            continue;
+
+        const char* value = strchr(line, ':');
+        if (value != NULL) {
+            value += strspn(value + 1, " \t") + 1;
+            snprintf(dst, dst_sz, "%.*s", (int)strcspn(value, "\n"), value);
+        }
+        break;
+    }
+
+    fclose(fp);
+}
+
+/*
+ * Write `str' as a JSON string. The values we write don't need more than
+ * escaping quotes and backslashes.
+ */
+static void write_json_string(FILE* dst, const char* str) {
+    fputc('"', dst);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', dst);
+        if ((unsigned char)*str >= 0x20)
+            fputc(*str, dst);
+    }
+    fputc('"', dst);
+}
+
+static void write_run(FILE* dst, const struct BenchRun* run) {
+    fputs("{\"commit\":", dst);
+    write_json_string(dst, run->commit);
+    fprintf(dst, ",\"time\":%lld,\"cpu\":", run->time);
+    write_json_string(dst, run->cpu);
+    fputs(",\"compiler\":", dst);
+    write_json_string(dst, run->compiler);
+#ifdef __OPTIMIZE__
+    fputs(",\"optimized\":true", dst);
+#else
+    fputs(",\"optimized\":false", dst);
+#endif
+
+    fputs(",\"benchmarks\":{", dst);
+    for (int i = 0; i < run->result_num; i++) {
+        const struct BenchResult* result = &run->results[i];
+        if (i > 0)
+            fputc(',', dst);
+        write_json_string(dst, result->name);
+        fputs(":[", dst);
+        for (int j = 0; j < result->sample_num; j++)
+            fprintf(dst, (j > 0) ? ",%.2f" : "%.2f", result->samples[j]);
+        fputc(']', dst);
+    }
+    fputs("}}\n", dst);
+}
+
+/*
+ * Copy a JSON string span into `dst', without decoding escapes.
+ */
+static void copy_span(char* dst, size_t dst_sz, const struct JsonSpan* span) {
+    snprintf(dst, dst_sz, "%.*s", (int)span->len, span->ptr);
+}
+
+/*
+ * Parse the benchmarks object of a run, with arrays of numbers.
+ */
+static bool parse_benchmarks(char* p, struct BenchRun* run) {
+    p = skip_json_space(p);
+    if (*p++ != '{')
+        return false;
+
+    while (*(p = skip_json_space(p)) != '}') {
+        struct JsonSpan key;
+        if (*p != '"' || (p = scan_json_value(p, &key)) == NULL)
+            return false;
+
+        p = skip_json_space(p);
+        if (*p++ != ':')
+            return false;
+        p = skip_json_space(p);
+        if (*p++ != '[')
+            return false;
+
+        if (run->result_num >= MAX_BENCHMARKS) {
+            fprintf(stderr, "More than %d benchmarks in a run.\n",
+                    MAX_BENCHMARKS);
+            return false;
+        }
+
+        struct BenchResult* result = &run->results[run->result_num++];
+        copy_span(result->name, sizeof(result->name), &key);
+        result->sample_num = 0;
+
+        while (*(p = skip_json_space(p)) != ']') {
+            char* end;
+            const double sample = strtod(p, &end);
+            if (end == p)
+                return false;
+            if (result->sample_num < MAX_SAMPLES)
+                result->samples[result->sample_num++] = sample;
+
+            p = skip_json_space(end);
+            if (*p == ',')
+                p++;
+        }
+        p++;
+
+        p = skip_json_space(p);
+        if (*p == ',')
+            p++;
+    }
+
+    return true;
+}
+
+/*
+ * Parse a line of the results file.
+ */
+static bool parse_run(char* line, struct BenchRun* run) {
+    memset(run, 0, sizeof(struct BenchRun));
+
+    char* p = skip_json_space(line);
+    if (*p++ != '{')
+        return false;
+
+    while (*(p = skip_json_space(p)) != '}') {
+        struct JsonSpan key, value;
+        if (*p != '"' || (p = scan_json_value(p, &key)) == NULL)
+            return false;
+
+        p = skip_json_space(p);
+        if (*p++ != ':')
+            return false;
+
+        p = skip_json_space(p);
+        char* value_start = p;
+        if ((p = scan_json_value(p, &value)) == NULL)
+            return false;
+
+        if (key.len == 6 && memcmp(key.ptr, "commit", 6) == 0)
+            copy_span(run->commit, sizeof(run->commit), &value);
+        else if (key.len == 4 && memcmp(key.ptr, "time", 4) == 0)
+            run->time = atoll(value.ptr);
+        else if (key.len == 3 && memcmp(key.ptr, "cpu", 3) == 0)
+            copy_span(run->cpu, sizeof(run->cpu), &value);
+        else if (key.len == 8 && memcmp(key.ptr, "compiler", 8) == 0)
+            copy_span(run->compiler, sizeof(run->compiler), &value);
+        else if (key.len == 10 && memcmp(key.ptr, "benchmarks", 10) == 0 &&
+                 !parse_benchmarks(value_start, run))
+            return false;
+
+        p = skip_json_space(p);
+        if (*p == ',')
+            p++;
+    }
+
+    return true;
+}
+
+/*
+ * Read all the runs of the results file. Invalid lines are skipped.
+ */
+static struct BenchRun* read_runs(const char* path, int* run_num) {
+    *run_num = 0;
+
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    struct BenchRun* runs = NULL;
+    int cap               = 0;
+
+    char* line      = NULL;
+    size_t line_cap = 0;
+    for (int line_num = 1; getline(&line, &line_cap, fp) > 0; line_num++) {
+        if (*run_num >= cap) {
+            cap  = (cap == 0) ? 16 : cap * 2;
+            runs = realloc(runs, cap * sizeof(struct BenchRun));
+        }
+
+        if (parse_run(line, &runs[*run_num]))
+            (*run_num)++;
+        else
+            fprintf(stderr, "%s:%d: Invalid run.\n", path, line_num);
+    }
+
+    free(line);
+    fclose(fp);
+    return runs;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Median of `num' values. The array is sorted.
+ */
+static double median(double* values, int num) {
+    qsort(values, num, sizeof(double), compare_doubles);
+    return (num % 2 == 1) ? values[num / 2]
+                          : (values[num / 2 - 1] + values[num / 2]) / 2;
+}
+
+/*
+ * Median of the samples of a benchmark, without sorting them.
+ */
+static double result_median(const struct BenchResult* result) {
+    double tmp[MAX_SAMPLES];
+    memcpy(tmp, result->samples, result->sample_num * sizeof(double));
+    return median(tmp, result->sample_num);
+}
+
+/*
+ * Median of a resample, with replacement, of `samples'.
+ */
+static double resample_median(const double* samples, int num, double* tmp) {
+    for (int i = 0; i < num; i++)
+        tmp[i] = samples[bench_random() % num];
+    return median(tmp, num);
+}
+
+/*
+ * Percentile bootstrap interval of the ratio between the medians of `new' and
+ * `old'.
+ */
+static void bootstrap_ratio(const struct BenchResult* old,
+                            const struct BenchResult* new, double* low,
+                            double* high) {
+    static double ratios[BENCH_RESAMPLES];
+    double tmp[MAX_SAMPLES];
+
+    for (int i = 0; i < BENCH_RESAMPLES; i++)
+        ratios[i] = resample_median(new->samples, new->sample_num, tmp) /
+                    resample_median(old->samples, old->sample_num, tmp);
+
+    qsort(ratios, BENCH_RESAMPLES, sizeof(double), compare_doubles);
+    const double tail = (1 - BENCH_CONFIDENCE) / 2;
+    *low              = ratios[(int)(tail * (BENCH_RESAMPLES - 1))];
+    *high             = ratios[(int)((1 - tail) * (BENCH_RESAMPLES - 1))];
+}
+
+static const struct BenchResult* find_result(const struct BenchRun* run,
+                                             const char* name) {
+    for (int i = 0; i < run->result_num; i++)
+        if (strcmp(run->results[i].name, name) == 0)
+            return &run->results[i];
+    return NULL;
+}
+
+/*
+ * Find a run from its index in the results file (negative indexes count from
+ * the end), or from a prefix of its commit, the last one if there are many.
+ */
+static const struct BenchRun* find_run(const struct BenchRun* runs,
+                                       int run_num, const char* str) {
+    char* end;
+    const long index = strtol(str, &end, 10);
+    if (*end == '\0' && end != str) {
+        const long i = (index < 0) ? run_num + index : index;
+        return (i >= 0 && i < run_num) ? &runs[i] : NULL;
+    }
+
+    for (int i = run_num - 1; i >= 0; i--)
+        if (strncmp(runs[i].commit, str, strlen(str)) == 0)
+            return &runs[i];
+    return NULL;
+}
+
+/*
+ * Compare two runs, and return the number of regressions.
+ */
+static int compare_runs(FILE* dst, const struct BenchRun* old,
+                        const struct BenchRun* new, double threshold) {
+    fprintf(dst, "old: %s (%s, %s)\n", old->commit, old->cpu, old->compiler);
+    fprintf(dst, "new: %s (%s, %s)\n", new->commit, new->cpu, new->compiler);
+    if (strcmp(old->cpu, new->cpu) != 0)
+        fprintf(dst, "Warning: the runs are from different CPUs.\n");
+    fputc('\n', dst);
+
+    fprintf(dst,
+            "%-18s %12s %12s %8s %18s\n",
+            "benchmark",
+            "old (ns/op)",
+            "new (ns/op)",
+            "change",
+            "95% interval");
+
+    int regressions = 0;
+    for (int i = 0; i < new->result_num; i++) {
+        const struct BenchResult* new_result = &new->results[i];
+        const struct BenchResult* old_result =
+          find_result(old, new_result->name);
+        if (old_result == NULL || old_result->sample_num == 0 ||
+            new_result->sample_num == 0)
+            continue;
+
+        const double old_median = result_median(old_result);
+        const double new_median = result_median(new_result);
+
+        double low, high;
+        bootstrap_ratio(old_result, new_result, &low, &high);
+
+        const char* verdict = "";
+        if (low > 1 + threshold / 100) {
+            verdict = "  REGRESSION";
+            regressions++;
+        } else if (high < 1 - threshold / 100) {
+            verdict = "  improvement";
+        }
+
+        fprintf(dst,
+                "%-18s %12.1f %12.1f %+7.1f%% [%+6.1f%%, %+6.1f%%]%s\n",
+                new_result->name,
+                old_median,
+                new_median,
+                (new_median / old_median - 1) * 100,
+                (low - 1) * 100,
+                (high - 1) * 100,
+                verdict);
+    }
+
+    return regressions;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int cmd_run(const char* path, const char* commit, int sample_num,
+                   const char* filter) {
+    struct BenchRun* run = calloc(1, sizeof(struct BenchRun));
+    run->time            = time(NULL);
+
+    if (commit != NULL)
+        snprintf(run->commit, sizeof(run->commit), "%s", commit);
+    else
+        read_command("git rev-parse --short HEAD 2>/dev/null",
+                     run->commit,
+                     sizeof(run->commit));
+    read_cpu_model(run->cpu, sizeof(run->cpu));
+#ifdef __clang__
+    snprintf(run->compiler, sizeof(run->compiler), "clang %s", __VERSION__);
+#else
+    snprintf(run->compiler, sizeof(run->compiler), "gcc %s", __VERSION__);
+#endif
+
+    if (!compile_style(&g_style, default_style))
+        abort();
+    init_harmony();
+    init_inputs();
+
+    for (size_t i = 0; i < LENGTH(benchmarks); i++) {
+        if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL)
+            continue;
+
+        struct BenchResult* result = &run->results[run->result_num++];
+        run_benchmark(&benchmarks[i], sample_num, result);
+
+        fprintf(stderr,
+                "%-18s %10.1f ns/op\n",
+                result->name,
+                result_median(result));
+    }
+
+    FILE* fp = fopen(path, "a");
+    if (fp == NULL) {
+        perror(path);
+        return 1;
+    }
+    write_run(fp, run);
+    fclose(fp);
+
+    fclose(g_bench_sink);
+    free(g_bench_sink_buf);
+    free(g_bench_song);
+    free(run);
+    return 0;
+}
+
+static int cmd_list(const char* path) {
+    int run_num;
+    struct BenchRun* runs = read_runs(path, &run_num);
+    if (runs == NULL)
+        return 1;
+
+    for (int i = 0; i < run_num; i++) {
+        const time_t time = runs[i].time;
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&time));
+        printf("%3d  %-12s %s  %d benchmarks  %s\n",
+               i,
+               runs[i].commit,
+               date,
+               runs[i].result_num,
+               runs[i].cpu);
+    }
+
+    free(runs);
+    return 0;
+}
+
+static int cmd_compare(const char* path, const char* old_str,
+                       const char* new_str, double threshold) {
+    int run_num;
+    struct BenchRun* runs = read_runs(path, &run_num);
+    if (runs == NULL)
+        return 1;
+
+    const struct BenchRun* old = find_run(runs, run_num, old_str);
+    const struct BenchRun* new = find_run(runs, run_num, new_str);
+    if (old == NULL || new == NULL) {
+        fprintf(stderr,
+                "Run not found: '%s'\n",
+                (old == NULL) ? old_str : new_str);
+        free(runs);
+        return 1;
+    }
+
+    const int regressions = compare_runs(stdout, old, new, threshold);
+    if (regressions > 0)
+        printf("\n%d regression%s.\n", regressions, regressions > 1 ? "s" : "");
+
+    free(runs);
+    return (regressions > 0) ? 2 : 0;
+}
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [-f RESULTS] run [-c COMMIT] [-n SAMPLES] [FILTER]\n"
+            "       %s [-f RESULTS] list\n"
+            "       %s [-f RESULTS] compare [-t PERCENT] [OLD [NEW]]\n"
+            "Runs the benchmarks whose name contains FILTER, and appends the\n"
+            "results to RESULTS (default: '" BENCH_RESULTS "'). OLD and NEW\n"
+            "are indexes of the runs in RESULTS, negative from the end, or\n"
+            "commit prefixes (default: -2 and -1). A regression is a\n"
+            "slowdown whose whole confidence interval is above PERCENT\n"
+            "(default: %.0f), and makes 'compare' exit with status 2.\n",
+            argv0,
+            argv0,
+            argv0,
+            BENCH_THRESHOLD);
+}
+
+int main(int argc, char** argv) {
+    const char* path = BENCH_RESULTS;
+
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-f") == 0) {
+        path = argv[i + 1];
+        i += 2;
+    }
+    if (i >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char* command = argv[i++];
+    if (strcmp(command, "run") == 0) {
+        const char* commit = NULL;
+        const char* filter = NULL;
+        int sample_num     = BENCH_SAMPLES;
+        for (; i < argc; i++) {
+            if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+                commit = argv[++i];
+            else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+                sample_num = atoi(argv[++i]);
+            else if (filter == NULL && argv[i][0] != '-')
+                filter = argv[i];
+            else
+                break;
+        }
+
+        if (i < argc || sample_num < 2 || sample_num > MAX_SAMPLES) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return cmd_run(path, commit, sample_num, filter);
+    }
+
+    if (strcmp(command, "list") == 0 && i == argc)
+        return cmd_list(path);
+
+    if (strcmp(command, "compare") == 0) {
+        double threshold = BENCH_THRESHOLD;
+        if (i + 1 < argc && strcmp(argv[i], "-t") == 0) {
+            threshold = atof(argv[i + 1]);
+            i += 2;
+        }
+
+        const char* old_str = (i < argc) ? argv[i++] : "-2";
+        const char* new_str = (i < argc) ? argv[i++] : "-1";
+        if (i == argc)
+            return cmd_compare(path, old_str, new_str, threshold);
+    }
+
+    print_usage(argv[0]);
+    return 1;
+}
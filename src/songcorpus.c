@@ -0,0 +1,1061 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * ============================================================================
+ *
+ * Corpus of songs, stored as a minimal DAWG (directed acyclic word graph).
+ *
+ * The songs generated by `godsong' share most of their prefixes (they all start
+ * with the same octave) and suffixes (they are built from the same few
+ * patterns). A DAWG shares both: it's a trie where equivalent subtrees are
+ * merged, built with the incremental algorithm for sorted input by Daciuk et
+ * al.
+ *
+ * The corpus file is used directly with `mmap'. After the `CorpusHeader', each
+ * node is stored as the list of its edges, sorted by label. An edge starts with
+ * a byte containing the label code (see `symbols' in the header) and these
+ * flags:
+ *
+ *   - EDGE_LAST: It's the last edge of the node.
+ *   - EDGE_FINAL: The target node ends a song.
+ *   - EDGE_NEXT: The target node is stored right after this node.
+ *
+ * If the code is `SYMBOL_ESCAPE', the label follows as a raw byte. If the flag
+ * `EDGE_NEXT' is not set, the target follows as a varint: its distance from the
+ * start of the edge, or zero for the node without edges. Finally, if the node
+ * has more than one edge, a varint with the number of songs below the target
+ * follows, which is enough for counting the songs with a prefix, and for
+ * converting between songs and their rank in lexicographic order. The last edge
+ * has no count, since it's the rest of the songs below the node.
+ *
+ * Since nodes are written with their only child right after them, the long
+ * tails that are unique to a song take a single byte for each character.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* getline() */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CORPUS_MAGIC   "SONGDAWG"
+#define CORPUS_VERSION 2
+
+/*
+ * Flags of the first byte of each edge. The rest of the byte is the label
+ * code.
+ */
+#define EDGE_LAST  0x20
+#define EDGE_FINAL 0x40
+#define EDGE_NEXT  0x80
+#define EDGE_CODE  0x1F
+
+/*
+ * Label code of characters that are not in the symbol table.
+ */
+#define SYMBOL_ESCAPE 0x1F
+
+/*
+ * Maximum size of an encoded edge: the flags, an escaped label and two
+ * varints.
+ */
+#define MAX_EDGE_SZ (2 + 2 * 10)
+
+struct CorpusHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_num;
+    uint64_t edge_num;
+    uint64_t song_num;
+    uint64_t text_size; /* Size of the songs, with a newline after each one */
+    uint64_t data_size;
+
+    /* Character of each label code, the most frequent ones */
+    char symbols[SYMBOL_ESCAPE];
+    char reserved;
+};
+
+/*
+ * Memory-mapped corpus.
+ */
+struct Corpus {
+    const void* map;
+    size_t map_sz;
+
+    const struct CorpusHeader* header;
+    const uint8_t* data;
+    uint64_t data_sz;
+};
+
+/*
+ * Position in the corpus: the offset of a node, and what the edge that led to
+ * it tells about it.
+ */
+struct Cursor {
+    uint64_t node;
+    uint64_t songs; /* Songs below the node, including itself */
+    bool final;
+};
+
+/*
+ * Decoded edge.
+ */
+struct Edge {
+    char label;
+    uint8_t flags;
+    uint64_t target; /* Offset of the target node */
+    uint64_t songs;  /* Songs below the target, only if `multi' */
+    bool multi;      /* Does the node have more than one edge? */
+};
+
+/*
+ * Node of the DAWG being built.
+ */
+struct BuildEdge {
+    uint8_t label;
+    uint32_t target;
+};
+
+struct BuildNode {
+    struct BuildEdge* edges;
+    uint32_t edge_num;
+    uint32_t edge_cap;
+    bool final;
+};
+
+/*
+ * State of the construction. The register is a hash set of the minimized
+ * nodes, and `order' lists them in the order they were registered, which
+ * always has children before their parents.
+ */
+struct Builder {
+    struct BuildNode* nodes;
+    uint32_t node_num, node_cap;
+
+    uint32_t* free_ids;
+    uint32_t free_num, free_cap;
+
+    uint32_t* table; /* Node IDs plus one, or zero if empty */
+    uint32_t table_cap, table_num;
+
+    uint32_t* order;
+    uint32_t order_num, order_cap;
+
+    /* Nodes of the path of the last song, which are not minimized yet */
+    uint32_t* path;
+    size_t path_cap;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static void* grow(void* ptr, uint32_t* cap, size_t elem_sz, uint32_t needed) {
+    if (needed <= *cap)
+        return ptr;
+
+    while (*cap < needed)
+        *cap = (*cap == 0) ? 64 : *cap * 2;
+    ptr = realloc(ptr, *cap * elem_sz);
+    if (ptr == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static uint32_t new_node(struct Builder* b) {
+    uint32_t id;
+    if (b->free_num > 0) {
+        id = b->free_ids[--b->free_num];
+    } else {
+        b->nodes = grow(b->nodes,
+                        &b->node_cap,
+                        sizeof(struct BuildNode),
+                        b->node_num + 1);
+        id       = b->node_num++;
+    }
+
+    struct BuildNode* node = &b->nodes[id];
+    node->edges            = NULL;
+    node->edge_num         = 0;
+    node->edge_cap         = 0;
+    node->final            = false;
+    return id;
+}
+
+static void free_node(struct Builder* b, uint32_t id) {
+    free(b->nodes[id].edges);
+    b->nodes[id].edges = NULL;
+
+    b->free_ids =
+      grow(b->free_ids, &b->free_cap, sizeof(uint32_t), b->free_num + 1);
+    b->free_ids[b->free_num++] = id;
+}
+
+static void add_edge(struct Builder* b, uint32_t id, uint8_t label,
+                     uint32_t target) {
+    struct BuildNode* node = &b->nodes[id];
+    node->edges            = grow(node->edges,
+                                  &node->edge_cap,
+                                  sizeof(struct BuildEdge),
+                                  node->edge_num + 1);
+
+    node->edges[node->edge_num].label  = label;
+    node->edges[node->edge_num].target = target;
+    node->edge_num++;
+}
+
+/*
+ * Hash of the right language of a node, which only depends on its finality and
+ * its edges, since its children are already minimized.
+ */
+static uint32_t hash_node(const struct BuildNode* node) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u ^ node->final;
+    for (uint32_t i = 0; i < node->edge_num; i++) {
+        hash = (hash ^ node->edges[i].label) * 16777619u;
+        hash = (hash ^ node->edges[i].target) * 16777619u;
+    }
+    return hash;
+}
+
+static bool equal_nodes(const struct BuildNode* a, const struct BuildNode* b) {
+    if (a->final != b->final || a->edge_num != b->edge_num)
+        return false;
+
+    for (uint32_t i = 0; i < a->edge_num; i++)
+        if (a->edges[i].label != b->edges[i].label ||
+            a->edges[i].target != b->edges[i].target)
+            return false;
+
+    return true;
+}
+
+static void register_insert(struct Builder* b, uint32_t id) {
+    uint32_t mask = b->table_cap - 1;
+    uint32_t i    = hash_node(&b->nodes[id]) & mask;
+    while (b->table[i] != 0)
+        i = (i + 1) & mask;
+    b->table[i] = id + 1;
+    b->table_num++;
+}
+
+/*
+ * Return the registered node equivalent to `id', or register it.
+ */
+static uint32_t register_node(struct Builder* b, uint32_t id) {
+    const struct BuildNode* node = &b->nodes[id];
+
+    const uint32_t mask = b->table_cap - 1;
+    uint32_t i          = hash_node(node) & mask;
+    for (; b->table[i] != 0; i = (i + 1) & mask) {
+        const uint32_t other = b->table[i] - 1;
+        if (equal_nodes(&b->nodes[other], node))
+            return other;
+    }
+
+    /* Keep the load factor under a half */
+    if ((b->table_num + 1) * 2 > b->table_cap) {
+        const uint32_t old_cap = b->table_cap;
+        uint32_t* old_table    = b->table;
+
+        b->table_cap = old_cap * 2;
+        b->table     = calloc(b->table_cap, sizeof(uint32_t));
+        b->table_num = 0;
+        for (uint32_t i = 0; i < old_cap; i++)
+            if (old_table[i] != 0)
+                register_insert(b, old_table[i] - 1);
+        free(old_table);
+    }
+    register_insert(b, id);
+
+    b->order =
+      grow(b->order, &b->order_cap, sizeof(uint32_t), b->order_num + 1);
+    b->order[b->order_num++] = id;
+    return id;
+}
+
+/*
+ * Minimize the nodes of the last path below `depth'. The path is replaced by
+ * the registered nodes, from the deepest one.
+ */
+static void minimize(struct Builder* b, size_t path_len, size_t depth) {
+    for (size_t i = path_len; i > depth; i--) {
+        const uint32_t parent = b->path[i - 1];
+        const uint32_t child  = b->path[i];
+
+        const uint32_t registered = register_node(b, child);
+        if (registered != child) {
+            struct BuildNode* node = &b->nodes[parent];
+            node->edges[node->edge_num - 1].target = registered;
+            free_node(b, child);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Read the songs of `fp', one per line, and sort them.
+ */
+static char** read_songs(FILE* fp, size_t* song_num) {
+    char** songs = NULL;
+    uint32_t cap = 0;
+    *song_num    = 0;
+
+    char* line      = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, fp)) > 0) {
+        if (line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if (line_len == 0)
+            continue;
+
+        songs = grow(songs, &cap, sizeof(char*), *song_num + 1);
+        songs[(*song_num)++] = strdup(line);
+    }
+    free(line);
+
+    qsort(songs, *song_num, sizeof(char*), compare_strings);
+    return songs;
+}
+
+/*
+ * Choose the label codes of the most frequent characters.
+ */
+static void choose_symbols(char** songs, size_t song_num, char* symbols,
+                           uint8_t* codes) {
+    uint64_t freqs[256] = { 0 };
+    for (size_t i = 0; i < song_num; i++)
+        for (const char* p = songs[i]; *p != '\0'; p++)
+            freqs[(uint8_t)*p]++;
+
+    memset(symbols, 0, SYMBOL_ESCAPE);
+    memset(codes, SYMBOL_ESCAPE, 256);
+    for (int code = 0; code < SYMBOL_ESCAPE; code++) {
+        int best = 0;
+        for (int c = 1; c < 256; c++)
+            if (freqs[c] > freqs[best])
+                best = c;
+        if (freqs[best] == 0)
+            break;
+
+        symbols[code] = best;
+        codes[best]   = code;
+        freqs[best]   = 0;
+    }
+}
+
+static size_t varint_size(uint64_t value) {
+    size_t len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static size_t put_varint(uint8_t* dst, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        dst[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    dst[len++] = value;
+    return len;
+}
+
+/*
+ * Growing byte buffer.
+ */
+struct Buffer {
+    uint8_t* data;
+    uint64_t len, cap;
+};
+
+static void buffer_reserve(struct Buffer* buf, uint64_t len) {
+    if (buf->len + len <= buf->cap)
+        return;
+
+    while (buf->len + len > buf->cap)
+        buf->cap = (buf->cap == 0) ? 4096 : buf->cap * 2;
+    buf->data = realloc(buf->data, buf->cap);
+    if (buf->data == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+}
+
+/*
+ * Encode the nodes, children first. The buffer is written backwards, and
+ * reversed at the end, so the targets are already known when a node is
+ * written, and its only child (if any) is right after it in the file.
+ */
+static void encode_nodes(const struct Builder* b, uint32_t root,
+                         const uint64_t* songs, const uint8_t* codes,
+                         struct Buffer* buf, uint64_t* edge_num) {
+    /* Where each node ends in the buffer, or UINT64_MAX if not written */
+    uint64_t* ends = malloc(b->node_num * sizeof(uint64_t));
+    for (uint32_t i = 0; i < b->node_num; i++)
+        ends[i] = UINT64_MAX;
+
+    /* Nodes to write, and the next edge to visit of each one */
+    uint32_t* stack = malloc(b->node_num * sizeof(uint32_t));
+    uint32_t* next  = malloc(b->node_num * sizeof(uint32_t));
+    uint32_t depth  = 0;
+    stack[depth]    = root;
+    next[depth++]   = 0;
+
+    while (depth > 0) {
+        const uint32_t id            = stack[depth - 1];
+        const struct BuildNode* node = &b->nodes[id];
+
+        /* Visit the children first */
+        if (next[depth - 1] < node->edge_num) {
+            const uint32_t child = node->edges[next[depth - 1]++].target;
+            if (ends[child] == UINT64_MAX) {
+                stack[depth]  = child;
+                next[depth++] = 0;
+            }
+            continue;
+        }
+        depth--;
+
+        /* Labels are bytes, so there are less than 256 edges */
+        const bool multi = node->edge_num > 1;
+        uint8_t edges[256][MAX_EDGE_SZ];
+        size_t edge_sz[256];
+
+        /*
+         * From the last edge, since the distance to a target includes the
+         * edges after this one.
+         */
+        uint64_t after = 0;
+        for (uint32_t i = node->edge_num; i-- > 0;) {
+            const uint32_t target          = node->edges[i].target;
+            const struct BuildNode* child = &b->nodes[target];
+            const uint8_t label           = node->edges[i].label;
+
+            uint8_t* p  = edges[i];
+            uint8_t byte = codes[label];
+            if (i == node->edge_num - 1)
+                byte |= EDGE_LAST;
+            if (child->final)
+                byte |= EDGE_FINAL;
+
+            /* The node without edges is always referenced as zero */
+            const bool is_next =
+              child->edge_num > 0 && ends[target] == buf->len;
+            if (is_next)
+                byte |= EDGE_NEXT;
+
+            *p++ = byte;
+            if (codes[label] == SYMBOL_ESCAPE)
+                *p++ = label;
+
+            uint8_t count[10];
+            size_t count_sz = 0;
+            if (multi && i != node->edge_num - 1)
+                count_sz = put_varint(count, songs[target]);
+
+            if (!is_next) {
+                uint64_t distance = 0;
+                if (child->edge_num > 0) {
+                    /* The distance includes its own size */
+                    const uint64_t base = buf->len - ends[target] + after +
+                                          (p - edges[i]) + count_sz;
+                    size_t distance_sz = 1;
+                    while (varint_size(base + distance_sz) > distance_sz)
+                        distance_sz++;
+                    distance = base + distance_sz;
+                }
+                p += put_varint(p, distance);
+            }
+            memcpy(p, count, count_sz);
+            p += count_sz;
+
+            edge_sz[i] = p - edges[i];
+            after += edge_sz[i];
+        }
+
+        /* Backwards, so the edges are in order once the buffer is reversed */
+        for (uint32_t i = node->edge_num; i-- > 0;) {
+            buffer_reserve(buf, edge_sz[i]);
+            for (size_t j = edge_sz[i]; j-- > 0;)
+                buf->data[buf->len++] = edges[i][j];
+        }
+
+        ends[id] = buf->len;
+        *edge_num += node->edge_num;
+    }
+
+    /* The root was written last, so it's at offset zero */
+    for (uint64_t i = 0; i < buf->len / 2; i++) {
+        const uint8_t tmp             = buf->data[i];
+        buf->data[i]                  = buf->data[buf->len - 1 - i];
+        buf->data[buf->len - 1 - i] = tmp;
+    }
+
+    free(ends);
+    free(stack);
+    free(next);
+}
+
+/*
+ * Build the DAWG of the sorted `songs', and write it to `fp'. Duplicated songs
+ * are only stored once.
+ */
+static bool write_corpus(FILE* fp, char** songs, size_t song_num) {
+    struct Builder b;
+    memset(&b, 0, sizeof(b));
+    b.table_cap         = 1024;
+    b.table             = calloc(b.table_cap, sizeof(uint32_t));
+    const uint32_t root = new_node(&b);
+
+    struct CorpusHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CORPUS_MAGIC, sizeof(header.magic));
+    header.version = CORPUS_VERSION;
+
+    uint8_t codes[256];
+    choose_symbols(songs, song_num, header.symbols, codes);
+
+    const char* prev = "";
+    size_t path_len  = 0;
+    for (size_t i = 0; i < song_num; i++) {
+        const char* song = songs[i];
+        if (strcmp(song, prev) == 0)
+            continue;
+
+        header.song_num++;
+        header.text_size += strlen(song) + 1;
+
+        /* Only the nodes after the common prefix can change */
+        size_t common = 0;
+        while (song[common] != '\0' && song[common] == prev[common])
+            common++;
+        minimize(&b, path_len, common);
+
+        const size_t song_len = strlen(song);
+        if (song_len + 1 > b.path_cap) {
+            b.path_cap = (song_len + 1) * 2;
+            b.path     = realloc(b.path, b.path_cap * sizeof(uint32_t));
+        }
+        b.path[0] = root;
+
+        for (size_t j = common; j < song_len; j++) {
+            const uint32_t child = new_node(&b);
+            add_edge(&b, b.path[j], (uint8_t)song[j], child);
+            b.path[j + 1] = child;
+        }
+        b.nodes[b.path[song_len]].final = true;
+
+        path_len = song_len;
+        prev     = song;
+    }
+    minimize(&b, path_len, 0);
+
+    /* Registered nodes have their children before them */
+    uint64_t* songs_below = calloc(b.node_num, sizeof(uint64_t));
+    for (uint32_t i = 0; i <= b.order_num; i++) {
+        const uint32_t id = (i < b.order_num) ? b.order[i] : root;
+        const struct BuildNode* node = &b.nodes[id];
+
+        songs_below[id] = node->final ? 1 : 0;
+        for (uint32_t j = 0; j < node->edge_num; j++)
+            songs_below[id] += songs_below[node->edges[j].target];
+    }
+
+    struct Buffer buf = { NULL, 0, 0 };
+    encode_nodes(&b, root, songs_below, codes, &buf, &header.edge_num);
+    header.node_num  = b.order_num + 1;
+    header.data_size = buf.len;
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(buf.data, 1, buf.len, fp);
+
+    for (uint32_t i = 0; i < b.node_num; i++)
+        free(b.nodes[i].edges);
+    free(b.nodes);
+    free(b.free_ids);
+    free(b.table);
+    free(b.order);
+    free(b.path);
+    free(songs_below);
+    free(buf.data);
+
+    return !ferror(fp);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static bool open_corpus(struct Corpus* corpus, const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+
+    corpus->map_sz = st.st_size;
+    corpus->map    = MAP_FAILED;
+    if (corpus->map_sz >= sizeof(struct CorpusHeader))
+        corpus->map =
+          mmap(NULL, corpus->map_sz, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (corpus->map == MAP_FAILED) {
+        fprintf(stderr, "Could not map the corpus '%s'.\n", path);
+        return false;
+    }
+
+    const struct CorpusHeader* header = corpus->map;
+    if (memcmp(header->magic, CORPUS_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CORPUS_VERSION ||
+        header->data_size != corpus->map_sz - sizeof(struct CorpusHeader)) {
+        fprintf(stderr, "Invalid corpus '%s'.\n", path);
+        munmap((void*)corpus->map, corpus->map_sz);
+        return false;
+    }
+
+    corpus->header  = header;
+    corpus->data    = (const uint8_t*)(header + 1);
+    corpus->data_sz = header->data_size;
+    return true;
+}
+
+static void close_corpus(struct Corpus* corpus) {
+    munmap((void*)corpus->map, corpus->map_sz);
+}
+
+/*
+ * Read a varint at `*pos'. Truncated varints read as zero.
+ */
+static uint64_t get_varint(const struct Corpus* corpus, uint64_t* pos) {
+    uint64_t value = 0;
+    for (int shift = 0; *pos < corpus->data_sz && shift < 64; shift += 7) {
+        const uint8_t byte = corpus->data[(*pos)++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    return 0;
+}
+
+/*
+ * Decode the edge at `*pos', which is the first one of its node if `first' is
+ * true, and move `*pos' after it. Returns false if there are no more edges.
+ */
+static bool get_edge(const struct Corpus* corpus, uint64_t* pos, bool first,
+                     struct Edge* edge) {
+    if (*pos >= corpus->data_sz)
+        return false;
+
+    const uint64_t start = *pos;
+    const uint8_t byte   = corpus->data[(*pos)++];
+    const uint8_t code = byte & EDGE_CODE;
+    edge->flags        = byte & ~EDGE_CODE;
+    if (first)
+        edge->multi = (edge->flags & EDGE_LAST) == 0;
+
+    if (code != SYMBOL_ESCAPE)
+        edge->label = corpus->header->symbols[code];
+    else if (*pos < corpus->data_sz)
+        edge->label = corpus->data[(*pos)++];
+
+    /* Resolved by `next_edge', since it depends on the end of the node */
+    edge->target = 0;
+    if ((edge->flags & EDGE_NEXT) == 0) {
+        const uint64_t distance = get_varint(corpus, pos);
+        edge->target = (distance == 0) ? corpus->data_sz : start + distance;
+    }
+
+    /* The count of the last edge is set by `next_edge' */
+    edge->songs = 0;
+    if (edge->multi && (edge->flags & EDGE_LAST) == 0)
+        edge->songs = get_varint(corpus, pos);
+    return true;
+}
+
+/*
+ * Iterate over the edges of a node. The `EDGE_NEXT' targets are only known at
+ * the end of the node, so the edges are decoded ahead.
+ */
+struct EdgeIterator {
+    uint64_t pos;
+    uint64_t songs; /* Songs below the edges that are left */
+    bool first;
+    bool done;
+};
+
+static bool next_edge(const struct Corpus* corpus, struct EdgeIterator* it,
+                      struct Edge* edge) {
+    if (it->done)
+        return false;
+
+    if (!get_edge(corpus, &it->pos, it->first, edge))
+        return false;
+    it->first = false;
+
+    if ((edge->flags & EDGE_NEXT) != 0) {
+        /* Skip the rest of the node to find where it ends */
+        uint64_t end = it->pos;
+        struct Edge rest;
+        rest.multi = edge->multi;
+        bool last  = (edge->flags & EDGE_LAST) != 0;
+        while (!last && get_edge(corpus, &end, false, &rest))
+            last = (rest.flags & EDGE_LAST) != 0;
+        edge->target = end;
+    }
+
+    if (edge->multi) {
+        if ((edge->flags & EDGE_LAST) != 0)
+            edge->songs = it->songs;
+        else
+            it->songs -= edge->songs;
+    }
+
+    if ((edge->flags & EDGE_LAST) != 0)
+        it->done = true;
+    return true;
+}
+
+/*
+ * Iterate over the edges of the node of `cursor'.
+ */
+static inline struct EdgeIterator edges_of(const struct Corpus* corpus,
+                                           const struct Cursor* cursor) {
+    struct EdgeIterator it = {
+        cursor->node,
+        cursor->songs - cursor->final,
+        true,
+        cursor->node >= corpus->data_sz,
+    };
+    return it;
+}
+
+static inline struct Cursor root_cursor(const struct Corpus* corpus) {
+    struct Cursor cursor = { 0, corpus->header->song_num, false };
+    return cursor;
+}
+
+/*
+ * Follow an edge of the node of `cursor'.
+ */
+static inline void follow_edge(struct Cursor* cursor, const struct Edge* edge) {
+    cursor->songs = edge->multi ? edge->songs : cursor->songs - cursor->final;
+    cursor->node  = edge->target;
+    cursor->final = (edge->flags & EDGE_FINAL) != 0;
+}
+
+/*
+ * Walk the characters of `str' from the root. Returns false if no song starts
+ * with `str'. If `rank' is not NULL, it's set to the number of songs that are
+ * lexicographically smaller than any song starting with `str'.
+ */
+static bool walk(const struct Corpus* corpus, const char* str,
+                 struct Cursor* cursor, uint64_t* rank) {
+    *cursor          = root_cursor(corpus);
+    uint64_t smaller = 0;
+
+    for (; *str != '\0'; str++) {
+        /* A song that ends here is smaller than the ones that continue */
+        if (cursor->final)
+            smaller++;
+
+        struct EdgeIterator it = edges_of(corpus, cursor);
+        struct Edge edge;
+        bool found = false;
+        while (next_edge(corpus, &it, &edge)) {
+            if (edge.label == *str) {
+                found = true;
+                break;
+            }
+            if ((uint8_t)edge.label > (uint8_t)*str)
+                break;
+            smaller += edge.songs;
+        }
+        if (!found)
+            return false;
+
+        follow_edge(cursor, &edge);
+    }
+
+    if (rank != NULL)
+        *rank = smaller;
+    return true;
+}
+
+static bool corpus_contains(const struct Corpus* corpus, const char* song) {
+    struct Cursor cursor;
+    return walk(corpus, song, &cursor, NULL) && cursor.final;
+}
+
+/*
+ * Number of songs starting with `prefix'.
+ */
+static uint64_t corpus_count(const struct Corpus* corpus, const char* prefix) {
+    struct Cursor cursor;
+    return walk(corpus, prefix, &cursor, NULL) ? cursor.songs : 0;
+}
+
+/*
+ * Position of `song' in the sorted corpus, or -1 if it's not there.
+ */
+static int64_t corpus_rank(const struct Corpus* corpus, const char* song) {
+    struct Cursor cursor;
+    uint64_t rank;
+    if (!walk(corpus, song, &cursor, &rank) || !cursor.final)
+        return -1;
+    return rank;
+}
+
+/*
+ * Write the song at position `rank' of the sorted corpus into `dst', which has
+ * space for `dst_sz' characters. Returns false if there is no such song, or if
+ * it doesn't fit.
+ */
+static bool corpus_select(const struct Corpus* corpus, uint64_t rank,
+                          char* dst, size_t dst_sz) {
+    if (rank >= corpus->header->song_num)
+        return false;
+
+    struct Cursor cursor = root_cursor(corpus);
+    size_t len           = 0;
+    for (;;) {
+        if (cursor.final) {
+            if (rank == 0)
+                break;
+            rank--;
+        }
+
+        struct EdgeIterator it = edges_of(corpus, &cursor);
+        struct Edge edge;
+        bool found = false;
+        while (next_edge(corpus, &it, &edge)) {
+            if (!edge.multi || rank < edge.songs) {
+                found = true;
+                break;
+            }
+            rank -= edge.songs;
+        }
+
+        if (!found || len + 1 >= dst_sz)
+            return false;
+        dst[len++] = edge.label;
+        follow_edge(&cursor, &edge);
+    }
+
+    dst[len] = '\0';
+    return true;
+}
+
+/*
+ * Write, in order, the songs below the node of `cursor', which start with the
+ * `len' characters of `buf'. Stops after `*limit' songs.
+ */
+static void enumerate(FILE* dst, const struct Corpus* corpus,
+                      const struct Cursor* cursor, char** buf, size_t* buf_sz,
+                      size_t len, uint64_t* limit) {
+    if (len + 1 >= *buf_sz) {
+        *buf_sz *= 2;
+        *buf = realloc(*buf, *buf_sz);
+    }
+
+    struct EdgeIterator it = edges_of(corpus, cursor);
+    struct Edge edge;
+    while (*limit > 0 && next_edge(corpus, &it, &edge)) {
+        (*buf)[len] = edge.label;
+        if ((edge.flags & EDGE_FINAL) != 0) {
+            fwrite(*buf, 1, len + 1, dst);
+            fputc('\n', dst);
+            (*limit)--;
+        }
+
+        struct Cursor child = *cursor;
+        follow_edge(&child, &edge);
+        enumerate(dst, corpus, &child, buf, buf_sz, len + 1, limit);
+    }
+}
+
+static void corpus_prefix(FILE* dst, const struct Corpus* corpus,
+                          const char* prefix, uint64_t limit) {
+    struct Cursor cursor;
+    if (!walk(corpus, prefix, &cursor, NULL) || limit == 0)
+        return;
+
+    size_t len    = strlen(prefix);
+    size_t buf_sz = len + 64;
+    char* buf     = malloc(buf_sz);
+    memcpy(buf, prefix, len);
+
+    if (cursor.final) {
+        fwrite(buf, 1, len, dst);
+        fputc('\n', dst);
+        limit--;
+    }
+
+    enumerate(dst, corpus, &cursor, &buf, &buf_sz, len, &limit);
+    free(buf);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Run a query for `arg', or for each line of stdin if it's "-".
+ */
+static void run_queries(const struct Corpus* corpus, const char* command,
+                        const char* arg) {
+    char* line      = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+
+    for (;;) {
+        const char* query = arg;
+        if (strcmp(arg, "-") == 0) {
+            if ((line_len = getline(&line, &line_cap, stdin)) <= 0)
+                break;
+            if (line[line_len - 1] == '\n')
+                line[line_len - 1] = '\0';
+            query = line;
+        }
+
+        if (strcmp(command, "contains") == 0)
+            puts(corpus_contains(corpus, query) ? "1" : "0");
+        else if (strcmp(command, "count") == 0)
+            printf("%" PRIu64 "\n", corpus_count(corpus, query));
+        else
+            printf("%" PRId64 "\n", corpus_rank(corpus, query));
+
+        if (query == arg)
+            break;
+    }
+
+    free(line);
+}
+
+static void print_stats(const struct Corpus* corpus) {
+    const struct CorpusHeader* header = corpus->header;
+    printf("Songs: %" PRIu64 "\n"
+           "Nodes: %" PRIu32 "\n"
+           "Edges: %" PRIu64 "\n"
+           "Text size: %" PRIu64 " bytes\n"
+           "Corpus size: %zu bytes (%.1f%% of the text)\n",
+           header->song_num,
+           header->node_num,
+           header->edge_num,
+           header->text_size,
+           corpus->map_sz,
+           (header->text_size > 0)
+             ? 100.0 * corpus->map_sz / header->text_size
+             : 0.0);
+}
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s build CORPUS\n"
+            "       %s CORPUS contains|count|rank SONG\n"
+            "       %s CORPUS prefix PREFIX [LIMIT]\n"
+            "       %s CORPUS select INDEX\n"
+            "       %s CORPUS stats\n"
+            "Builds CORPUS from the songs of stdin, one per line, or queries\n"
+            "it. With '-' as the SONG, queries each line of stdin.\n",
+            argv0,
+            argv0,
+            argv0,
+            argv0,
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "build") == 0) {
+        size_t song_num;
+        char** songs = read_songs(stdin, &song_num);
+
+        FILE* fp = fopen(argv[2], "wb");
+        if (fp == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+
+        bool result = write_corpus(fp, songs, song_num);
+        if (fclose(fp) != 0)
+            result = false;
+
+        for (size_t i = 0; i < song_num; i++)
+            free(songs[i]);
+        free(songs);
+
+        if (!result) {
+            fprintf(stderr, "Could not write the corpus '%s'.\n", argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct Corpus corpus;
+    if (!open_corpus(&corpus, argv[1]))
+        return 1;
+
+    const char* command = argv[2];
+    int result          = 0;
+    if (argc == 3 && strcmp(command, "stats") == 0) {
+        print_stats(&corpus);
+    } else if (argc == 4 && (strcmp(command, "contains") == 0 ||
+                             strcmp(command, "count") == 0 ||
+                             strcmp(command, "rank") == 0)) {
+        run_queries(&corpus, command, argv[3]);
+    } else if ((argc == 4 || argc == 5) && strcmp(command, "prefix") == 0) {
+        const uint64_t limit =
+          (argc == 5) ? strtoull(argv[4], NULL, 10) : UINT64_MAX;
+        corpus_prefix(stdout, &corpus, argv[3], limit);
+    } else if (argc == 4 && strcmp(command, "select") == 0) {
+        char song[4096];
+        if (corpus_select(&corpus, strtoull(argv[3], NULL, 10), song,
+                          sizeof(song))) {
+            puts(song);
+        } else {
+            fprintf(stderr, "No song at that index.\n");
+            result = 1;
+        }
+    } else {
+        print_usage(argv[0]);
+        result = 1;
+    }
+
+    close_corpus(&corpus);
+    return result;
+}
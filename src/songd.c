@@ -0,0 +1,808 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * ============================================================================
+ *
+ * Generation and conversion service for clients in the same host. It includes
+ * `godsong.c' and `song2pmx.c', and serves their functions through shared
+ * memory.
+ *
+ * Clients connect to a Unix socket, which is only used for the handshake: the
+ * server forks a worker for each client, which creates a `memfd' with a
+ * `ShmChannel' and sends it to the client. The channel contains two
+ * single-producer, single-consumer rings, one for requests and one for
+ * responses. Each ring is a circular buffer of `ShmRecord' structures, which
+ * are written and read in place.
+ *
+ * The head and tail indexes of the rings are also used as futex words. A side
+ * only sleeps after polling an empty (or full) ring for a while, and the other
+ * side only calls `futex' if the sleeping flag is set, so there are no system
+ * calls while both sides are busy. Sleeps have a timeout, so a side can notice
+ * when its peer closed the socket.
+ */
+
+#define _GNU_SOURCE /* memfd_create(), syscall() */
+#define SONG_LIBRARY
+
+#include "godsong.c"
+#include "song2pmx.c"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Size of each ring, which must be a power of two, and maximum size of a
+ * record, including its header.
+ */
+#define SHM_RING_SIZE  (1 << 20)
+#define SHM_MAX_RECORD (SHM_RING_SIZE / 4)
+
+/*
+ * Number of times a ring is polled before sleeping, and timeout of each sleep
+ * in milliseconds.
+ */
+#define SHM_SPIN    4096
+#define SHM_TIMEOUT 100
+
+enum EShmTypes {
+    SHM_GENERATE = 1, /* arg: length, complexity, voices */
+    SHM_CONVERT  = 2, /* arg: meter top, meter bottom; data: song */
+};
+
+enum EShmStatus {
+    SHM_OK        = 0,
+    SHM_INVALID   = 1, /* Invalid request, the data contains the error */
+    SHM_TOO_LARGE = 2, /* The result doesn't fit in a record */
+};
+
+/*
+ * Request or response in a ring. The data is always null-terminated. Records
+ * are aligned to 8 bytes, and a record with a zero size means that the next
+ * one is at the start of the ring.
+ */
+struct ShmRecord {
+    uint32_t size;     /* Size of the record, including this header */
+    uint32_t id;       /* Chosen by the client, and copied to the response */
+    uint8_t type;      /* See `EShmTypes' */
+    uint8_t status;    /* See `EShmStatus', only in responses */
+    uint16_t arg[4];   /* Depends on `type' */
+    uint32_t data_len; /* Length of `data', without the null terminator */
+    char data[];
+};
+
+/*
+ * Each index is only written by one side, and it's in a different cache line
+ * than the other one.
+ */
+struct ShmRing {
+    /* Written by the producer */
+    uint32_t head;
+    uint32_t producer_waiting;
+    char pad0[56];
+
+    /* Written by the consumer */
+    uint32_t tail;
+    uint32_t consumer_waiting;
+    char pad1[56];
+
+    char data[SHM_RING_SIZE];
+};
+
+/*
+ * Contents of the shared memory.
+ */
+struct ShmChannel {
+    struct ShmRing requests;
+    struct ShmRing responses;
+};
+
+/*
+ * One side of a channel. The server sends through the responses ring, and the
+ * client through the requests ring.
+ */
+struct ShmConn {
+    int sock;
+    bool closed;
+    struct ShmChannel* channel;
+    struct ShmRing* tx;
+    struct ShmRing* rx;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static inline size_t record_size(size_t data_len) {
+    const size_t size = sizeof(struct ShmRecord) + data_len + 1;
+    return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Maximum data length of the records returned by `shm_reserve'.
+ */
+static inline size_t record_capacity(const struct ShmRecord* record) {
+    return record->size - sizeof(struct ShmRecord) - 1;
+}
+
+static inline void cpu_relax(void) {
+#ifdef __SSE2__
+    _mm_pause();
+#endif
+}
+
+/*
+ * Did the peer close its side of the socket?
+ */
+static bool peer_closed(struct ShmConn* conn) {
+    struct pollfd pfd = { conn->sock, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0)
+        return false;
+
+    char c;
+    if ((pfd.revents & (POLLHUP | POLLERR)) != 0 ||
+        recv(conn->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+        conn->closed = true;
+
+    return conn->closed;
+}
+
+/*
+ * Wait until `*word' is different from `value'. The `waiting' flag tells the
+ * other side that it needs to wake us. Returns false if the peer is gone.
+ */
+static bool ring_wait(struct ShmConn* conn, uint32_t* word, uint32_t* waiting,
+                      uint32_t value) {
+    for (int i = 0; i < SHM_SPIN; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value)
+            return true;
+        cpu_relax();
+    }
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == value) {
+        const struct timespec timeout = { 0, SHM_TIMEOUT * 1000000L };
+        syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+    return !peer_closed(conn);
+}
+
+/*
+ * Publish a new value of an index, and wake the other side if it's sleeping.
+ */
+static void ring_publish(uint32_t* word, uint32_t* waiting, uint32_t value) {
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) != 0)
+        syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Reserve a record with space for `data_len' bytes in the transmit ring. The
+ * record is not visible to the peer until `shm_commit'. Returns NULL if there
+ * is no space and `wait' is false, or if the peer is gone.
+ */
+static struct ShmRecord* shm_reserve(struct ShmConn* conn, size_t data_len,
+                                     bool wait) {
+    struct ShmRing* ring = conn->tx;
+    const size_t size    = record_size(data_len);
+    if (size > SHM_MAX_RECORD || conn->closed)
+        return NULL;
+
+    for (;;) {
+        const uint32_t head   = ring->head;
+        const uint32_t tail   = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        const uint32_t offset = head & (SHM_RING_SIZE - 1);
+
+        /* Records are never split, so we might need to skip the end */
+        const uint32_t pad =
+          (offset + size > SHM_RING_SIZE) ? SHM_RING_SIZE - offset : 0;
+
+        if (SHM_RING_SIZE - (head - tail) >= pad + size) {
+            struct ShmRecord* record;
+            if (pad > 0) {
+                *(uint32_t*)&ring->data[offset] = 0;
+                __atomic_store_n(&ring->head, head + pad, __ATOMIC_RELEASE);
+                record = (struct ShmRecord*)&ring->data[0];
+            } else {
+                record = (struct ShmRecord*)&ring->data[offset];
+            }
+
+            record->size     = size;
+            record->status   = SHM_OK;
+            record->data_len = 0;
+            return record;
+        }
+
+        if (!wait ||
+            !ring_wait(conn, &ring->tail, &ring->producer_waiting, tail))
+            return NULL;
+    }
+}
+
+/*
+ * Make a reserved record visible to the peer. Its size is reduced to the final
+ * `data_len', which must not exceed the reserved one.
+ */
+static void shm_commit(struct ShmConn* conn, struct ShmRecord* record) {
+    struct ShmRing* ring = conn->tx;
+
+    record->data[record->data_len] = '\0';
+    record->size                   = record_size(record->data_len);
+    ring_publish(&ring->head,
+                 &ring->consumer_waiting,
+                 ring->head + record->size);
+}
+
+/*
+ * Return the next record of the receive ring, without removing it. Returns
+ * NULL if the ring is empty and `wait' is false, or if the peer is gone.
+ */
+static struct ShmRecord* shm_receive(struct ShmConn* conn, bool wait) {
+    struct ShmRing* ring = conn->rx;
+    if (conn->closed)
+        return NULL;
+
+    for (;;) {
+        const uint32_t tail = ring->tail;
+        const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (head != tail) {
+            const uint32_t offset    = tail & (SHM_RING_SIZE - 1);
+            struct ShmRecord* record = (struct ShmRecord*)&ring->data[offset];
+            if (record->size != 0)
+                return record;
+
+            ring_publish(&ring->tail,
+                         &ring->producer_waiting,
+                         tail + (SHM_RING_SIZE - offset));
+            continue;
+        }
+
+        if (!wait ||
+            !ring_wait(conn, &ring->head, &ring->consumer_waiting, head))
+            return NULL;
+    }
+}
+
+/*
+ * Remove a record returned by `shm_receive' from the ring. It can't be used
+ * after this.
+ */
+static void shm_release(struct ShmConn* conn, struct ShmRecord* record) {
+    struct ShmRing* ring = conn->rx;
+    ring_publish(&ring->tail,
+                 &ring->producer_waiting,
+                 ring->tail + record->size);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Map the channel in `fd' into `conn'.
+ */
+static bool shm_map(struct ShmConn* conn, int fd, bool is_server) {
+    void* addr = mmap(NULL,
+                      sizeof(struct ShmChannel),
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED,
+                      fd,
+                      0);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    conn->closed  = false;
+    conn->channel = addr;
+    conn->tx = is_server ? &conn->channel->responses : &conn->channel->requests;
+    conn->rx = is_server ? &conn->channel->requests : &conn->channel->responses;
+    return true;
+}
+
+static void shm_close(struct ShmConn* conn) {
+    munmap(conn->channel, sizeof(struct ShmChannel));
+    close(conn->sock);
+}
+
+static bool socket_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: '%s'\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/*
+ * Connect to the server in `path', and map the channel it sends us.
+ */
+static bool shm_connect(struct ShmConn* conn, const char* path) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path))
+        return false;
+
+    conn->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->sock < 0 ||
+        connect(conn->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return false;
+    }
+
+    /* The channel is received as ancillary data of a single byte */
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg;
+    if (recvmsg(conn->sock, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+        (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "The server didn't send a channel.\n");
+        close(conn->sock);
+        return false;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    const bool result = shm_map(conn, fd, false);
+    close(fd);
+
+    if (!result)
+        close(conn->sock);
+    return result;
+}
+
+/*
+ * Create a channel for the client in `sock', and send it.
+ */
+static bool shm_accept(struct ShmConn* conn, int sock) {
+    conn->sock = sock;
+
+    const int fd = memfd_create("songd", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, sizeof(struct ShmChannel)) < 0) {
+        perror("memfd");
+        return false;
+    }
+
+    if (!shm_map(conn, fd, true)) {
+        close(fd);
+        return false;
+    }
+
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { 0 };
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    const bool result = sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+    close(fd);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void set_result(struct ShmRecord* response, int status,
+                       const char* str) {
+    const size_t len = strlen(str);
+    if (len > record_capacity(response)) {
+        response->status = SHM_TOO_LARGE;
+        return;
+    }
+
+    memcpy(response->data, str, len);
+    response->data_len = len;
+    response->status   = status;
+}
+
+static void serve_generate(const struct ShmRecord* request,
+                           struct ShmRecord* response) {
+    const int len        = request->arg[0];
+    const int complexity = request->arg[1];
+    const int voice_num  = (request->arg[2] == 0) ? 1 : request->arg[2];
+
+    const char* error = check_song_args(len, complexity, voice_num);
+    if (error != NULL) {
+        set_result(response, SHM_INVALID, error);
+        return;
+    }
+
+    if (voice_num == 1) {
+        char* song = godsong(len, complexity);
+        set_result(response, SHM_OK, song);
+        free(song);
+        return;
+    }
+
+    char* voices[MAX_VOICES];
+    godvoices(len, complexity, get_meter_prefix(len), voices, voice_num);
+
+    /* Staves are written from the lowest one, like in `godsong.c' */
+    const size_t capacity = record_capacity(response);
+    size_t pos            = 0;
+    for (int i = voice_num - 1; i >= 0; i--) {
+        const size_t voice_len = strlen(voices[i]);
+        if (pos + voice_len + 1 <= capacity) {
+            memcpy(&response->data[pos], voices[i], voice_len);
+            response->data[pos + voice_len] = '\n';
+        } else {
+            response->status = SHM_TOO_LARGE;
+        }
+        pos += voice_len + 1;
+        free(voices[i]);
+    }
+
+    if (response->status == SHM_OK)
+        response->data_len = pos;
+}
+
+static void serve_convert(const struct ShmRecord* request,
+                          struct ShmRecord* response) {
+    if (request->arg[0] != 0 && request->arg[1] != 0) {
+        g_meter_top    = request->arg[0];
+        g_meter_bottom = request->arg[1];
+    }
+
+    /* The PMX is written directly into the response */
+    const size_t capacity = record_capacity(response);
+    FILE* fp              = fmemopen(response->data, capacity + 1, "w");
+    if (fp == NULL) {
+        set_result(response, SHM_TOO_LARGE, "");
+        return;
+    }
+
+    char* warnings;
+    size_t warnings_sz;
+    g_warnings = open_memstream(&warnings, &warnings_sz);
+    if (g_warnings == NULL) {
+        fprintf(stderr, "Could not allocate the warnings.\n");
+        abort();
+    }
+
+    const bool converted = convert_text(request->data, fp);
+    fclose(g_warnings);
+    g_warnings = NULL;
+
+    const long len = ftell(fp);
+    if (ferror(fp) || len < 0 || (size_t)len >= capacity)
+        response->status = SHM_TOO_LARGE;
+    else
+        response->data_len = len;
+    fclose(fp);
+
+    /* The error is the last warning, like in the record mode of `song2pmx' */
+    if (!converted) {
+        size_t error_len;
+        char* error      = last_warning(warnings, warnings_sz, &error_len);
+        error[error_len] = '\0';
+
+        const char* message = (error_len > 0) ? error : "Invalid song.";
+        set_result(response, SHM_INVALID, message);
+    } else {
+        const char* warning = warnings;
+        while (warning < warnings + warnings_sz) {
+            const char* newline = strchr(warning, '\n');
+            fprintf(stderr,
+                    "Warning: %.*s\n",
+                    (int)(newline - warning),
+                    warning);
+            warning = newline + 1;
+        }
+    }
+    free(warnings);
+}
+
+/*
+ * Serve the requests of a single client, until it disconnects.
+ */
+static void serve_client(struct ShmConn* conn) {
+    struct ShmRecord* request;
+    while ((request = shm_receive(conn, true)) != NULL) {
+        /* Results are written in place, so reserve the maximum size */
+        const size_t max_data = SHM_MAX_RECORD - sizeof(struct ShmRecord) - 1;
+        struct ShmRecord* response = shm_reserve(conn, max_data, true);
+        if (response == NULL)
+            break;
+
+        response->id   = request->id;
+        response->type = request->type;
+
+        switch (request->type) {
+            case SHM_GENERATE:
+                serve_generate(request, response);
+                break;
+            case SHM_CONVERT:
+                serve_convert(request, response);
+                break;
+            default:
+                set_result(response, SHM_INVALID, "Invalid request type.");
+                break;
+        }
+
+        shm_release(conn, request);
+        shm_commit(conn, response);
+    }
+
+    shm_close(conn);
+}
+
+/*
+ * Accept clients in the socket `path', forking a worker for each of them.
+ */
+static int serve(const char* path) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path))
+        return 1;
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(sock, SOMAXCONN) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    /* Workers are not waited for */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        const int client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            return 1;
+        }
+
+        const pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+
+            /* Otherwise, all workers would generate the same songs */
+            srand(time(NULL) ^ getpid());
+
+            struct ShmConn conn;
+            if (!shm_accept(&conn, client))
+                _exit(1);
+            serve_client(&conn);
+            _exit(0);
+        }
+
+        if (pid < 0)
+            perror("fork");
+        close(client);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * State of the client mode.
+ */
+struct Client {
+    struct ShmConn conn;
+    FILE* dst;
+    uint32_t sent;
+    uint32_t received;
+};
+
+/*
+ * Write a response in the format of the client mode.
+ */
+static void print_response(FILE* dst, const struct ShmRecord* response) {
+    switch (response->status) {
+        case SHM_OK:
+            fwrite(response->data, 1, response->data_len, dst);
+            if (response->type == SHM_GENERATE)
+                fputc('\n', dst);
+            break;
+        case SHM_INVALID:
+            fprintf(stderr,
+                    "Request %" PRIu32 ": %s\n",
+                    response->id,
+                    response->data);
+            break;
+        case SHM_TOO_LARGE:
+            fprintf(stderr, "Request %" PRIu32 ": Too large.\n", response->id);
+            break;
+    }
+}
+
+/*
+ * Read the next response. Returns false if there are none, or if the server is
+ * gone.
+ */
+static bool client_receive(struct Client* client, bool wait) {
+    if (client->received == client->sent)
+        return false;
+
+    struct ShmRecord* response = shm_receive(&client->conn, wait);
+    if (response == NULL)
+        return false;
+
+    print_response(client->dst, response);
+    shm_release(&client->conn, response);
+    client->received++;
+    return true;
+}
+
+/*
+ * Reserve a request. While the requests ring is full, the server might be
+ * waiting for us to read its responses, so we do that instead of sleeping.
+ */
+static struct ShmRecord* client_reserve(struct Client* client,
+                                        size_t data_len) {
+    for (;;) {
+        struct ShmRecord* request =
+          shm_reserve(&client->conn, data_len, false);
+        if (request != NULL || client->conn.closed)
+            return request;
+
+        if (!client_receive(client, true))
+            return shm_reserve(&client->conn, data_len, true);
+    }
+}
+
+/*
+ * Send a line of the client mode as a request. Returns false if the line is
+ * not valid.
+ */
+static bool send_request(struct Client* client, const char* line) {
+    struct ShmRecord* request;
+
+    if (line[0] == 'g' && line[1] == ' ') {
+        int len, complexity, voice_num = 1;
+        if (sscanf(line + 2, "%d %d %d", &len, &complexity, &voice_num) < 2 ||
+            len < 0 || len > UINT16_MAX || complexity < 0 ||
+            complexity > UINT16_MAX || voice_num < 0 || voice_num > UINT16_MAX)
+            return false;
+
+        request = client_reserve(client, 0);
+        if (request == NULL)
+            return false;
+
+        request->type   = SHM_GENERATE;
+        request->arg[0] = len;
+        request->arg[1] = complexity;
+        request->arg[2] = voice_num;
+    } else if (line[0] == 'c' && line[1] == ' ') {
+        const char* song = line + 2;
+        const size_t len = strlen(song);
+
+        request = client_reserve(client, len);
+        if (request == NULL)
+            return false;
+
+        request->type   = SHM_CONVERT;
+        request->arg[0] = 0;
+        request->arg[1] = 0;
+
+        /* Lines are unescaped, so "\n" separates the staves */
+        memcpy(request->data, song, len + 1);
+        request->data_len = unescape_text(request->data);
+    } else {
+        return false;
+    }
+
+    request->id = client->sent++;
+    shm_commit(&client->conn, request);
+    return true;
+}
+
+/*
+ * Send the requests from `src' to the server in `path', writing the responses
+ * to `dst' in the same order. Requests are pipelined, and the responses are
+ * read while there are requests to send.
+ */
+static int run_client(const char* path, FILE* src, FILE* dst) {
+    struct Client client = { .dst = dst };
+    if (!shm_connect(&client.conn, path))
+        return 1;
+
+    char* line      = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, src)) > 0) {
+        if (line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if (line_len == 0)
+            continue;
+
+        while (client_receive(&client, false))
+            ;
+
+        if (record_size(line_len) > SHM_MAX_RECORD) {
+            fprintf(stderr, "Request too large.\n");
+            continue;
+        }
+
+        if (!send_request(&client, line)) {
+            if (client.conn.closed)
+                break;
+            fprintf(stderr, "Invalid request: '%s'\n", line);
+        }
+    }
+
+    while (client_receive(&client, true))
+        ;
+
+    free(line);
+    shm_close(&client.conn);
+
+    if (client.received < client.sent) {
+        fprintf(stderr, "The server closed the connection.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Other programs can include this file with SONGD_LIBRARY */
+#ifndef SONGD_LIBRARY
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s --serve SOCKET | --client SOCKET\n"
+            "Serves godsong and song2pmx through shared memory, to the\n"
+            "clients of SOCKET. With '--client', sends the requests from\n"
+            "stdin, one per line, and writes the results to stdout:\n"
+            "    g LENGTH COMPLEXITY [VOICES]\n"
+            "    c SONG\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "--client") == 0)
+        return run_client(argv[2], stdin, stdout);
+
+    if (argc != 3 || strcmp(argv[1], "--serve") != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!compile_style(&g_style, default_style))
+        abort();
+    init_harmony();
+
+    return serve(argv[2]);
+}
+
+#endif /* SONGD_LIBRARY */
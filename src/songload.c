@@ -0,0 +1,808 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * ============================================================================
+ *
+ * Load generator for the generation and conversion functions. It sends a list
+ * of requests, either synthesized or replayed from a log, to one of these
+ * targets:
+ *
+ *     inproc
+ *         Call the functions of `godsong.c' and `song2pmx.c' directly.
+ *
+ *     shm:SOCKET
+ *         Send the requests to the `songd' server of SOCKET.
+ *
+ *     cli:DIR
+ *         Run `godsong.out' and `song2pmx.out' from DIR for each request.
+ *
+ * Arrivals are open-loop: each request has a scheduled time, and it's sent at
+ * that time even if the previous ones didn't finish. Latencies are measured
+ * from the scheduled time, not from the moment the request could actually be
+ * sent, so a slow target can't hide its queueing delay (what Gil Tene calls
+ * "coordinated omission").
+ *
+ * The request log has one request per line, in the format of the `songd'
+ * client, preceded by its arrival time in seconds:
+ *
+ *     0.000125 g 8 2 1
+ *     0.000740 c 4eABqC\n3eDEFqG
+ */
+
+#define SONGD_LIBRARY
+
+#include "songd.c"
+
+#include <math.h>
+
+/*
+ * Types of requests, which are reported separately.
+ */
+enum ELoadTypes {
+    LOAD_GENERATE = 0, /* A single voice */
+    LOAD_VOICES   = 1, /* Several harmonized voices */
+    LOAD_CONVERT  = 2, /* A single staff */
+    LOAD_STAVES   = 3, /* Several staves */
+    LOAD_TYPE_NUM = 4,
+};
+
+static const char* load_type_names[LOAD_TYPE_NUM] = {
+    "generate",
+    "generate-voices",
+    "convert",
+    "convert-staves",
+};
+
+/*
+ * Maximum number of `cli' requests running at the same time. Requests that
+ * arrive while there are this many processes are sent late, but their latency
+ * is still measured from their arrival.
+ */
+#define MAX_PROCESSES 256
+
+/*
+ * Maximum number of phrases in the songs of synthesized conversions.
+ */
+#define MAX_PHRASES 32
+
+/*
+ * Time before each arrival that is spent polling instead of sleeping, see
+ * `sleep_until'.
+ */
+#define LOAD_SPIN_NS 1000000
+
+struct LoadRequest {
+    int64_t arrival; /* Nanoseconds since the start */
+    uint8_t type;    /* See `ELoadTypes' */
+    int len;
+    int complexity;
+    int voice_num;
+    char* song; /* Only for conversions */
+
+    /* Filled when the request finishes */
+    int64_t latency;
+    bool failed;
+};
+
+struct LoadOptions {
+    double rate;
+    int count;
+    double mix[LOAD_TYPE_NUM];
+    double complexities[3];
+    int max_phrases;
+    uint64_t seed;
+    double speed;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static inline int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Wait until `time' nanoseconds after `start'. Sleeps can take much longer than
+ * requested, and that delay would be reported as latency of the target, so the
+ * last `LOAD_SPIN_NS' are spent polling the clock.
+ */
+static void sleep_until(int64_t start, int64_t time) {
+    const int64_t target = start + time - LOAD_SPIN_NS;
+    if (target > now_ns()) {
+        struct timespec ts = { target / 1000000000, target % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR)
+            ;
+    }
+
+    while (now_ns() < start + time)
+        cpu_relax();
+}
+
+/*
+ * The load generator uses its own random numbers, so the arrivals don't depend
+ * on the number of calls to `rand' made by `godsong'.
+ */
+static uint64_t g_load_random;
+
+static uint64_t load_random(void) {
+    /* xorshift64* */
+    g_load_random ^= g_load_random >> 12;
+    g_load_random ^= g_load_random << 25;
+    g_load_random ^= g_load_random >> 27;
+    return g_load_random * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Uniform random number in [0, 1).
+ */
+static double load_uniform(void) {
+    return (load_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Random index of `weights', with a probability proportional to its weight.
+ */
+static int load_choose(const double* weights, int num) {
+    double total = 0;
+    for (int i = 0; i < num; i++)
+        total += weights[i];
+
+    double x = load_uniform() * total;
+    for (int i = 0; i < num - 1; i++) {
+        if (x < weights[i])
+            return i;
+        x -= weights[i];
+    }
+    return num - 1;
+}
+
+/*
+ * Parse a list of comma-separated weights.
+ */
+static bool parse_weights(const char* str, double* weights, int num) {
+    for (int i = 0; i < num; i++) {
+        char* end;
+        weights[i]      = strtod(str, &end);
+        const char last = (i == num - 1) ? '\0' : ',';
+        if (end == str || weights[i] < 0 || *end != last)
+            return false;
+        str = end + 1;
+    }
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Append `str' to the song of `request'.
+ */
+static void append_song(struct LoadRequest* request, size_t* song_len,
+                        const char* str) {
+    const size_t len = strlen(str);
+    request->song    = realloc(request->song, *song_len + len + 1);
+    memcpy(&request->song[*song_len], str, len + 1);
+    *song_len += len;
+}
+
+/*
+ * Generate the song of a conversion request, with a random number of phrases
+ * and one staff for each voice.
+ */
+static void synthesize_song(struct LoadRequest* request, int max_phrases) {
+    const int phrase_num = 1 + load_random() % max_phrases;
+    const char* prefix   = get_meter_prefix(request->len);
+
+    char* phrases[MAX_PHRASES][MAX_VOICES];
+    size_t song_len = 0;
+    request->song   = NULL;
+    append_song(request, &song_len, "");
+
+    for (int i = 0; i < phrase_num; i++)
+        godvoices(request->len,
+                  request->complexity,
+                  prefix,
+                  phrases[i],
+                  request->voice_num);
+
+    /* Staves are written from the lowest one */
+    for (int v = request->voice_num - 1; v >= 0; v--) {
+        for (int i = 0; i < phrase_num; i++) {
+            append_song(request, &song_len, phrases[i][v]);
+            free(phrases[i][v]);
+        }
+        if (v > 0)
+            append_song(request, &song_len, "\n");
+    }
+}
+
+/*
+ * Synthesize the requests, with Poisson arrivals.
+ */
+static struct LoadRequest* synthesize(const struct LoadOptions* opts) {
+    struct LoadRequest* requests =
+      calloc(opts->count, sizeof(struct LoadRequest));
+
+    double arrival = 0;
+    for (int i = 0; i < opts->count; i++) {
+        struct LoadRequest* request = &requests[i];
+
+        /* Exponential inter-arrival times */
+        arrival += -log(1.0 - load_uniform()) / opts->rate;
+        request->arrival = (int64_t)(arrival * 1e9);
+
+        request->type = load_choose(opts->mix, LOAD_TYPE_NUM);
+        request->len =
+          g_style.meter_beats[load_random() % g_style.meter_num];
+        request->complexity = load_choose(opts->complexities, 3);
+
+        const bool multi =
+          request->type == LOAD_VOICES || request->type == LOAD_STAVES;
+        const int max_voices = (g_style.octave_base + 1 < MAX_VOICES)
+                                 ? g_style.octave_base + 1
+                                 : MAX_VOICES;
+        request->voice_num =
+          multi ? 2 + load_random() % (max_voices - 1) : 1;
+
+        if (request->type == LOAD_CONVERT || request->type == LOAD_STAVES)
+            synthesize_song(request, opts->max_phrases);
+    }
+
+    return requests;
+}
+
+/*
+ * Write the requests in the log format.
+ */
+static void write_log(FILE* dst, const struct LoadRequest* requests,
+                      int count) {
+    for (int i = 0; i < count; i++) {
+        const struct LoadRequest* request = &requests[i];
+        fprintf(dst, "%.6f ", request->arrival / 1e9);
+
+        if (request->song == NULL) {
+            fprintf(dst,
+                    "g %d %d %d\n",
+                    request->len,
+                    request->complexity,
+                    request->voice_num);
+            continue;
+        }
+
+        fputs("c ", dst);
+        for (const char* p = request->song; *p != '\0'; p++) {
+            if (*p == '\n')
+                fputs("\\n", dst);
+            else if (*p == '\\')
+                fputs("\\\\", dst);
+            else
+                fputc(*p, dst);
+        }
+        fputc('\n', dst);
+    }
+}
+
+/*
+ * Read the requests of a log. Arrival times are divided by `speed'.
+ */
+static struct LoadRequest* read_log(FILE* src, double speed, int* count) {
+    struct LoadRequest* requests = NULL;
+    int cap                      = 0;
+    *count                       = 0;
+
+    char* line      = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    for (int line_num = 1; (line_len = getline(&line, &line_cap, src)) > 0;
+         line_num++) {
+        if (line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if (line_len == 0)
+            continue;
+
+        if (*count >= cap) {
+            cap      = (cap == 0) ? 1024 : cap * 2;
+            requests = realloc(requests, cap * sizeof(struct LoadRequest));
+        }
+        struct LoadRequest* request = &requests[*count];
+        memset(request, 0, sizeof(struct LoadRequest));
+
+        char* p;
+        const double arrival = strtod(line, &p);
+        request->arrival     = (int64_t)(arrival / speed * 1e9);
+
+        int len, complexity, voice_num = 1;
+        if (p[0] == ' ' && p[1] == 'g' &&
+            sscanf(p + 2, "%d %d %d", &len, &complexity, &voice_num) >= 2) {
+            request->type       = (voice_num > 1) ? LOAD_VOICES : LOAD_GENERATE;
+            request->len        = len;
+            request->complexity = complexity;
+            request->voice_num  = voice_num;
+        } else if (p[0] == ' ' && p[1] == 'c' && p[2] == ' ') {
+            const size_t song_len = unescape_text(p + 3);
+            p[3 + song_len]       = '\0';
+
+            request->type = (strchr(p + 3, '\n') != NULL) ? LOAD_STAVES
+                                                          : LOAD_CONVERT;
+            request->song = strdup(p + 3);
+        } else {
+            fprintf(stderr, "Invalid request in line %d.\n", line_num);
+            continue;
+        }
+
+        (*count)++;
+    }
+
+    free(line);
+    return requests;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Run the requests by calling the functions directly. The requests that arrive
+ * while another one runs are queued.
+ */
+static void run_inproc(struct LoadRequest* requests, int count) {
+    FILE* sink = fopen("/dev/null", "w");
+    if (sink == NULL) {
+        perror("/dev/null");
+        exit(1);
+    }
+
+    const int64_t start = now_ns();
+    for (int i = 0; i < count; i++) {
+        struct LoadRequest* request = &requests[i];
+        if (now_ns() - start < request->arrival)
+            sleep_until(start, request->arrival);
+
+        if (request->song != NULL) {
+            request->failed = !convert_text(request->song, sink);
+        } else if (check_song_args(request->len,
+                                   request->complexity,
+                                   request->voice_num) != NULL) {
+            request->failed = true;
+        } else {
+            char* voices[MAX_VOICES];
+            godvoices(request->len,
+                      request->complexity,
+                      get_meter_prefix(request->len),
+                      voices,
+                      request->voice_num);
+            for (int v = 0; v < request->voice_num; v++)
+                free(voices[v]);
+        }
+
+        request->latency = now_ns() - start - request->arrival;
+    }
+
+    fclose(sink);
+}
+
+static inline bool fits_shm_arg(int value) {
+    return value >= 0 && value <= UINT16_MAX;
+}
+
+/*
+ * Write a request into a record of the `songd' channel.
+ */
+static bool send_shm(struct ShmConn* conn, struct LoadRequest* requests,
+                     uint32_t id) {
+    const struct LoadRequest* request = &requests[id];
+    const size_t len = (request->song == NULL) ? 0 : strlen(request->song);
+
+    struct ShmRecord* record = shm_reserve(conn, len, false);
+    if (record == NULL)
+        return false;
+
+    record->id = id;
+    if (request->song != NULL) {
+        record->type   = SHM_CONVERT;
+        record->arg[0] = 0;
+        record->arg[1] = 0;
+        memcpy(record->data, request->song, len);
+        record->data_len = len;
+    } else {
+        /* If the arguments don't fit, send a length that is always invalid */
+        const bool fits = fits_shm_arg(request->len) &&
+                          fits_shm_arg(request->complexity) &&
+                          fits_shm_arg(request->voice_num);
+
+        record->type   = SHM_GENERATE;
+        record->arg[0] = fits ? request->len : 0;
+        record->arg[1] = request->complexity;
+        record->arg[2] = request->voice_num;
+    }
+
+    shm_commit(conn, record);
+    return true;
+}
+
+/*
+ * Run the requests through a `songd' server. The responses are polled while
+ * there are requests in flight, so they are timestamped as soon as possible.
+ */
+static bool run_shm(const char* path, struct LoadRequest* requests, int count) {
+    struct ShmConn conn;
+    if (!shm_connect(&conn, path))
+        return false;
+
+    const int64_t start = now_ns();
+    int64_t progress    = 0;
+    int sent = 0, received = 0;
+    while (received < count && !conn.closed) {
+        const int64_t now = now_ns() - start;
+
+        /* Send all the requests that already arrived, if they fit */
+        while (sent < count && requests[sent].arrival <= now &&
+               send_shm(&conn, requests, sent))
+            sent++;
+
+        struct ShmRecord* response;
+        while ((response = shm_receive(&conn, false)) != NULL) {
+            struct LoadRequest* request = &requests[response->id];
+            request->latency = now_ns() - start - request->arrival;
+            request->failed  = response->status != SHM_OK;
+            shm_release(&conn, response);
+            received++;
+            progress = now;
+        }
+
+        if (received == sent && sent < count) {
+            sleep_until(start, requests[sent].arrival);
+            progress = requests[sent].arrival;
+        } else if (now - progress > SHM_TIMEOUT * 1000000L) {
+            peer_closed(&conn);
+            progress = now;
+        } else {
+            cpu_relax();
+        }
+    }
+
+    shm_close(&conn);
+    if (received < count) {
+        fprintf(stderr, "The server closed the connection.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Start the process for a request, writing the song to its stdin. Returns its
+ * PID, or -1 on errors.
+ */
+static pid_t spawn_request(const char* dir, const struct LoadRequest* request) {
+    char path[PATH_MAX];
+    snprintf(path,
+             sizeof(path),
+             "%s/%s",
+             dir,
+             (request->song == NULL) ? "godsong.out" : "song2pmx.out");
+
+    char len[12], complexity[12], voice_num[12];
+    snprintf(len, sizeof(len), "%d", request->len);
+    snprintf(complexity, sizeof(complexity), "%d", request->complexity);
+    snprintf(voice_num, sizeof(voice_num), "%d", request->voice_num);
+
+    int fds[2];
+    if (request->song != NULL && pipe(fds) < 0)
+        return -1;
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+        const int null = open("/dev/null", O_RDWR);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+
+        if (request->song != NULL) {
+            dup2(fds[0], STDIN_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            execl(path, path, (char*)NULL);
+        } else {
+            execl(path,
+                  path,
+                  "-l",
+                  len,
+                  "-c",
+                  complexity,
+                  "-v",
+                  voice_num,
+                  (char*)NULL);
+        }
+        _exit(127);
+    }
+
+    if (request->song != NULL) {
+        close(fds[0]);
+        if (pid > 0) {
+            /* Songs are small enough for the pipe buffer */
+            const size_t song_len = strlen(request->song);
+            if (write(fds[1], request->song, song_len) != (ssize_t)song_len)
+                perror("write");
+        }
+        close(fds[1]);
+    }
+
+    return pid;
+}
+
+/*
+ * Run the requests by starting a process for each of them.
+ */
+static bool run_cli(const char* dir, struct LoadRequest* requests, int count) {
+    pid_t pids[MAX_PROCESSES];
+    int indexes[MAX_PROCESSES];
+    int running = 0;
+
+    /* Closed pipes of finished processes shouldn't kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    const int64_t start = now_ns();
+    int sent = 0, received = 0;
+    while (received < count) {
+        while (sent < count && running < MAX_PROCESSES &&
+               requests[sent].arrival <= now_ns() - start) {
+            const pid_t pid = spawn_request(dir, &requests[sent]);
+            if (pid < 0) {
+                perror("fork");
+                return false;
+            }
+            pids[running]    = pid;
+            indexes[running] = sent++;
+            running++;
+        }
+
+        int status;
+        pid_t pid;
+        while (running > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < running; i++) {
+                if (pids[i] != pid)
+                    continue;
+
+                struct LoadRequest* request = &requests[indexes[i]];
+                request->latency = now_ns() - start - request->arrival;
+                request->failed =
+                  !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+                received++;
+
+                running--;
+                pids[i]    = pids[running];
+                indexes[i] = indexes[running];
+                break;
+            }
+        }
+
+        if (running == 0 && sent < count)
+            sleep_until(start, requests[sent].arrival);
+        else
+            usleep(50);
+    }
+
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int compare_latencies(const void* a, const void* b) {
+    const int64_t x = *(const int64_t*)a;
+    const int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of the sorted `latencies', in microseconds.
+ */
+static double percentile(const int64_t* latencies, int num, double p) {
+    int rank = (int)ceil(p / 100.0 * num);
+    if (rank < 1)
+        rank = 1;
+    return latencies[rank - 1] / 1e3;
+}
+
+static void print_report(FILE* dst, const struct LoadRequest* requests,
+                         int count, int64_t elapsed) {
+    const double offered = (count > 0 && requests[count - 1].arrival > 0)
+                             ? count / (requests[count - 1].arrival / 1e9)
+                             : 0;
+    fprintf(dst,
+            "%d requests in %.3f s: %.1f req/s offered, %.1f req/s done\n\n",
+            count,
+            elapsed / 1e9,
+            offered,
+            count / (elapsed / 1e9));
+
+    fprintf(dst,
+            "%-16s %8s %7s %10s %10s %10s %10s %10s %10s\n",
+            "type",
+            "count",
+            "errors",
+            "req/s",
+            "p50 (us)",
+            "p90 (us)",
+            "p99 (us)",
+            "p99.9 (us)",
+            "max (us)");
+
+    int64_t* latencies = malloc(count * sizeof(int64_t));
+    for (int type = 0; type < LOAD_TYPE_NUM; type++) {
+        int num = 0, errors = 0;
+        for (int i = 0; i < count; i++) {
+            if (requests[i].type != type)
+                continue;
+            latencies[num++] = requests[i].latency;
+            if (requests[i].failed)
+                errors++;
+        }
+        if (num == 0)
+            continue;
+
+        qsort(latencies, num, sizeof(int64_t), compare_latencies);
+        fprintf(dst,
+                "%-16s %8d %7d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                load_type_names[type],
+                num,
+                errors,
+                num / (elapsed / 1e9),
+                percentile(latencies, num, 50),
+                percentile(latencies, num, 90),
+                percentile(latencies, num, 99),
+                percentile(latencies, num, 99.9),
+                latencies[num - 1] / 1e3);
+    }
+    free(latencies);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [-t TARGET] [-r RATE] [-n COUNT] [-m MIX]\n"
+            "          [-c COMPLEXITIES] [-p PHRASES] [-s SEED]\n"
+            "          [-l LOG [-x SPEED] | -w LOG]\n"
+            "Sends COUNT requests at RATE per second, with Poisson arrivals,\n"
+            "to TARGET ('inproc', 'shm:SOCKET' or 'cli:DIR'), and reports\n"
+            "the latency of each type of request. MIX and COMPLEXITIES are\n"
+            "comma-separated weights of 'generate,generate-voices,convert,\n"
+            "convert-staves' and of each complexity. Converted songs have up\n"
+            "to PHRASES phrases. With '-w', writes the requests to LOG\n"
+            "instead of sending them. With '-l', replays the requests of LOG,\n"
+            "SPEED times faster.\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    const char* target     = "inproc";
+    const char* read_path  = NULL;
+    const char* write_path = NULL;
+
+    struct LoadOptions opts = {
+        .rate         = 1000,
+        .count        = 10000,
+        .mix          = { 70, 5, 20, 5 },
+        .complexities = { 1, 1, 1 },
+        .max_phrases  = 8,
+        .seed         = time(NULL),
+        .speed        = 1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:r:n:m:c:p:s:l:x:w:h")) != -1) {
+        switch (opt) {
+            case 't':
+                target = optarg;
+                break;
+            case 'r':
+                opts.rate = atof(optarg);
+                break;
+            case 'n':
+                opts.count = atoi(optarg);
+                break;
+            case 'm':
+                if (!parse_weights(optarg, opts.mix, LOAD_TYPE_NUM)) {
+                    fprintf(stderr, "Invalid mix: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (!parse_weights(optarg, opts.complexities, 3)) {
+                    fprintf(stderr, "Invalid complexities: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                opts.max_phrases = atoi(optarg);
+                break;
+            case 's':
+                opts.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                read_path = optarg;
+                break;
+            case 'x':
+                opts.speed = atof(optarg);
+                break;
+            case 'w':
+                write_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (opts.rate <= 0 || opts.count <= 0 || opts.speed <= 0 ||
+        opts.max_phrases < 1 || opts.max_phrases > MAX_PHRASES) {
+        fprintf(stderr, "Invalid options.\n");
+        return 1;
+    }
+
+    if (!compile_style(&g_style, default_style))
+        abort();
+    init_harmony();
+
+    /* Zero is a fixed point of xorshift */
+    g_load_random = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+    srand(opts.seed);
+
+    struct LoadRequest* requests;
+    int count;
+    if (read_path != NULL) {
+        FILE* fp = fopen(read_path, "r");
+        if (fp == NULL) {
+            perror(read_path);
+            return 1;
+        }
+        requests = read_log(fp, opts.speed, &count);
+        fclose(fp);
+    } else {
+        requests = synthesize(&opts);
+        count    = opts.count;
+    }
+
+    if (write_path != NULL) {
+        FILE* fp = fopen(write_path, "w");
+        if (fp == NULL) {
+            perror(write_path);
+            return 1;
+        }
+        write_log(fp, requests, count);
+        fclose(fp);
+        return 0;
+    }
+
+    const int64_t start = now_ns();
+    bool result         = true;
+    if (strcmp(target, "inproc") == 0) {
+        run_inproc(requests, count);
+    } else if (strncmp(target, "shm:", 4) == 0) {
+        result = run_shm(target + 4, requests, count);
+    } else if (strncmp(target, "cli:", 4) == 0) {
+        result = run_cli(target + 4, requests, count);
+    } else {
+        fprintf(stderr, "Invalid target: '%s'\n", target);
+        return 1;
+    }
+    const int64_t elapsed = now_ns() - start;
+
+    if (result)
+        print_report(stdout, requests, count, elapsed);
+
+    for (int i = 0; i < count; i++)
+        free(requests[i].song);
+    free(requests);
+    return result ? 0 : 1;
+}